@@ -1,8 +1,26 @@
 #ifndef NTP_H
 #define NTP_H
 
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define NTP_PORT 123
+#define NTP_PACKET_SIZE 48
+#define NTP_SYNC_INTERVAL 3600      //  seconds between syncs once the drift is known
+#define NTP_LEARNING_INTERVAL 64    //  seconds between the first syncs, while the drift is measured
+#define NTP_LEARNING_SYNCS 4
+#define NTP_RETRY_INTERVAL 30       //  seconds after a failed sync
+#define NTP_TIMEOUT 2000            //  ms to wait for an answer
+#define NTP_MAX_DELAY 500           //  ms, answers with a longer round trip are not trusted
+#define NTP_MAX_DRIFT_PPM 500       //  anything beyond this is a measurement error, not the crystal
+
 namespace ntp
 {
+    extern bool IsSynced();
+    extern uint64_t Micros64();
+    extern uint64_t EpochMs();
+    extern void ToJson(JsonObject obj);
+
     extern void setup();
     extern void loop();
 }
@@ -0,0 +1,61 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define ARENA_SIZE 5120        //  bytes reserved at boot for JSON documents and other transient work
+#define ARENA_BLOCK_SIZE 128   //  bytes per formatting buffer
+#define ARENA_BLOCK_COUNT 8    //  formatting buffers in the pool, 16 at most
+#define ARENA_MAX_FALLBACKS 4  //  heap allocations made for requests that did not fit
+
+namespace arena
+{
+    //  Allocations are stacked and released in reverse order. Releasing one releases
+    //  everything allocated after it. Requests that do not fit fall back to the heap,
+    //  those are freed one by one, or by the scope they were made in.
+    extern void *Allocate(size_t size);
+    extern void *Reallocate(void *ptr, size_t size);
+    extern void Release(void *ptr);
+
+    //  Everything allocated from the arena while a scope lives is released when it ends
+    class scope
+    {
+    public:
+        scope();
+        ~scope();
+
+    private:
+        size_t mark;
+        uint8_t fallbackMark;
+    };
+
+    struct allocator
+    {
+        void *allocate(size_t size) { return Allocate(size); }
+        void deallocate(void *ptr) { Release(ptr); }
+        void *reallocate(void *ptr, size_t size) { return Reallocate(ptr, size); }
+    };
+
+    //  Drop-in for DynamicJsonDocument, the pool comes from the arena
+    typedef BasicJsonDocument<allocator> jsonDocument;
+
+    //  A formatting buffer from the fixed-block pool, returned when it goes out of scope
+    class buffer
+    {
+    public:
+        buffer();
+        ~buffer();
+
+        operator char *() { return data; }
+        static const size_t size = ARENA_BLOCK_SIZE;
+
+    private:
+        char *data;
+        int8_t block; //  -1 if it came from the heap
+    };
+
+    extern void ToJson(JsonObject obj);
+}
+
+#endif
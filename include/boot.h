@@ -0,0 +1,31 @@
+#ifndef BOOT_H
+#define BOOT_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+namespace boot
+{
+    //  Milestones of a boot, in the order they normally happen
+    enum BOOT_PHASES
+    {
+        BOOT_FILESYSTEM,
+        BOOT_SETTINGS,
+        BOOT_NETWORK,
+        BOOT_MQTT,
+        BOOT_SENSORS,
+        BOOT_SETUP_DONE,
+        BOOT_WIFI,
+        BOOT_INTERNET,
+        BOOT_FIRST_READING,
+        BOOT_FIRST_PUBLISH,
+        BOOT_PHASE_COUNT
+    };
+
+    extern bool reported;
+
+    extern void Mark(BOOT_PHASES phase);
+    extern void ToJson(JsonObject obj);
+}
+
+#endif
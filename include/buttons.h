@@ -1,7 +1,11 @@
 #ifndef BUTTONS_H
 #define BUTTONS_H
 
+#include <ArduinoJson.h>
+
 namespace buttons{
+    extern void ToJson(JsonObject obj);
+
     extern void setup();
     extern void loop();
 }
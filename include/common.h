@@ -7,14 +7,29 @@
 namespace common
 {
     static const int32_t DEBUG_SPEED = 115200;
-    static const String HARDWARE_ID = "hall sensors";
-    static const String HARDWARE_VERSION = "1.0";
-    static const String FIRMWARE_ID = "hall";
+
+    //  In flash, use them through FPSTR() or the _P functions
+    extern const char HARDWARE_ID[];
+    extern const char HARDWARE_VERSION[];
+    extern const char FIRMWARE_ID[];
+
+    //  RTC user memory layout, in 4-byte blocks. Survives resets but not power loss.
+    //  Blocks 0..31 belong to the core, eboot's command is written there by every Update.end().
+    enum RTC_MEMORY_BLOCKS
+    {
+        RTC_PULSE_COUNTER = 32, //  4 blocks
+        RTC_WIFI_CACHE = 36,    //  10 blocks
+        RTC_POWER = 46,         //  29 blocks
+        RTC_SENSOR_CACHE = 75,  //  52 blocks, POWER_CACHED_SENSORS snapshots
+        RTC_NEXT_FREE_BLOCK = 127,
+        RTC_USER_BLOCKS = 128
+    };
 
     extern String GetDeviceMAC();
-    extern char *GetFullDateTime(const char *formattingString, size_t size);
+    extern char *GetFullDateTime(const char *formattingString, char *dest, size_t size);
     extern void DateTimeToString(char *dest, time_t localTime);
     extern String TimeIntervalToString(const time_t time);
+    extern char *Uint64ToString(uint64_t value, char *dest);
     extern String GetDeviceMAC();
 
     extern void setup();
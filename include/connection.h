@@ -1,8 +1,17 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
+#include <ArduinoJson.h>
+
 namespace connection
 {
+    extern bool isWiFiConnected;
+    extern bool isInternetConnected;
+
+    extern void ReportFailure();
+    extern void ToJson(JsonObject obj);
+
+    extern void setup();
     extern void loop();
 }
 
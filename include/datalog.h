@@ -0,0 +1,59 @@
+#ifndef DATALOG_H
+#define DATALOG_H
+
+#include <Arduino.h>
+
+#define DATALOG_SEGMENT_SIZE 4096  //  bytes per segment file
+#define DATALOG_MAX_SEGMENTS 16    //  oldest segment is deleted beyond this
+#define DATALOG_BUFFER_SIZE 256    //  records are batched in RAM up to this size...
+#define DATALOG_FLUSH_INTERVAL 300 //  ...or for this many seconds before being written
+
+#define DATALOG_CHANNEL_PIR 32
+#define DATALOG_CHANNEL_HALL 33
+#define DATALOG_CHANNELS 34 //  0..31 are the thermometers
+
+struct logRecord
+{
+    uint32_t time;
+    uint8_t channel;
+    int16_t value;
+};
+
+struct logCursor
+{
+    uint32_t segment;
+    uint32_t offset;
+    uint32_t time;
+    int16_t previousValues[DATALOG_CHANNELS];
+};
+
+//  Where the writer is in the current segment, kept over deep sleep so a wake appends to it
+struct logState
+{
+    uint32_t segment;
+    uint32_t segmentBytes;
+    uint32_t time;
+    int16_t previousValues[DATALOG_CHANNELS];
+};
+
+namespace datalog
+{
+    extern void LogTemperature(uint8_t sensor, int16_t raw);
+    extern void LogEvent(uint8_t channel, bool state);
+    extern void LogValue(uint8_t channel, int16_t value);
+    extern void Flush();
+
+    extern void OpenCursor(logCursor &cursor);
+    extern size_t ReadRecords(logCursor &cursor, logRecord *records, size_t maxRecords);
+    extern size_t FormatRecord(const logRecord &record, bool json, char *dest, size_t size);
+
+    extern void StartBackfill(uint32_t since);
+
+    extern void GetState(logState &state);
+    extern void Resume(const logState &state);
+
+    extern void setup();
+    extern void loop();
+}
+
+#endif
@@ -1,9 +1,25 @@
 #ifndef FILESYSTEM_H
 #define FILESYSTEM_H
 
+#include <Arduino.h>
+
+#define FS_VERSION_FILE "/fsversion"
+#define FS_PRESERVED_MAX_SIZE 4096 //  bytes of a single preserved file
+
 namespace filesystem
 {
+    //  Writing a LittleFS image replaces every file. The image is staged in the free flash
+    //  (ATOMIC_FS_UPDATE) and only installed by the bootloader once it is complete and
+    //  verified, the running filesystem and web UI stay intact until then. The device's own
+    //  files (settings, filter overrides, counters, WiFi cache) are kept in a flash record
+    //  and written back into the new filesystem on the first boot.
+    //  size 0 means all the space there is
+    extern bool BeginImageUpdate(size_t size, const char *version);
+    extern bool EndImageUpdate(bool evenIfRemaining);
+    extern void AbortImageUpdate();
+    extern String ImageVersion();
+
     extern void setup();
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,44 @@
+#ifndef FILTERS_H
+#define FILTERS_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define FILTER_MAX_MEDIAN_WINDOW 7
+#define FILTER_EMA_OFF 256         //  EMA weight is in 1/256 steps, 256 passes the input through
+#define FILTER_MAX_SILENT_READINGS 10 //  publish at least every this many readings, even inside the deadband
+
+struct filterConfig
+{
+    uint8_t medianWindow; //  1 (off), 3, 5 or 7 readings
+    uint16_t emaWeight;   //  weight of the new reading, 1..256 / 256
+    uint16_t maxRate;     //  max change per reading in 1/16 °C, 0 = off
+    uint16_t deadband;    //  min change to publish in 1/16 °C, 0 = publish every reading
+};
+
+//  What has to survive a deep sleep for the filters to continue where they stopped
+struct filterSnapshot
+{
+    int32_t ema;
+    int16_t lastPublished;
+    uint8_t silentReadings;
+    uint8_t primed;
+};
+
+namespace filters
+{
+    extern filterConfig configs[32];
+
+    extern int16_t Apply(uint8_t sensor, int16_t raw);
+    extern bool ShouldPublish(uint8_t sensor, int16_t filtered);
+    extern void Reset(uint8_t sensor);
+    extern void GetSnapshot(uint8_t sensor, filterSnapshot &snapshot);
+    extern void RestoreSnapshot(uint8_t sensor, const filterSnapshot &snapshot);
+
+    extern bool SetConfig(uint8_t sensor, JsonVariantConst params);
+    extern bool SaveConfig();
+
+    extern void setup();
+}
+
+#endif
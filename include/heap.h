@@ -0,0 +1,48 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define HEAP_SAMPLE_INTERVAL 1000      //  ms
+#define HEAP_HYSTERESIS 1024           //  bytes above the low mark before memory counts as recovered
+#define HEAP_TREND_HOURS 24            //  hourly minimums of the largest free block kept for the heartbeat
+#define HEAP_RESTART_AFTER_LOW 600     //  s of low memory before a restart is planned
+#define HEAP_RESTART_AFTER_CRITICAL 60 //  s of critical memory before restarting whatever happens
+#define HEAP_QUIET_HOUR_START 2        //  local time, a planned restart waits for this window...
+#define HEAP_QUIET_HOUR_END 5          //  ...and a vacant room
+
+namespace heap
+{
+    enum HEAP_STATES
+    {
+        HEAP_OK,
+        HEAP_LOW,     //  largest free block below the low mark
+        HEAP_CRITICAL //  largest free block below half the low mark
+    };
+
+    //  What the node does about low memory, each level includes the ones before
+    enum HEAP_ACTIONS
+    {
+        HEAP_ACTION_MONITOR,
+        HEAP_ACTION_REJECT_WEB, //  the web server answers 503 instead of building pages
+        HEAP_ACTION_SHRINK,     //  the MQTT buffer shrinks
+        HEAP_ACTION_RESTART     //  a controlled restart at a quiet time
+    };
+
+    extern HEAP_STATES state;
+
+    extern bool RejectWebRequests();
+    extern bool ShrinkBuffers();
+
+    //  The scheduler brackets every task with these to keep a low-water mark per task
+    extern void TaskStarted();
+    extern uint32_t TaskLowWater();
+
+    extern void ToJson(JsonObject obj);
+
+    extern void setup();
+    extern void loop();
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <Arduino.h>
+
+#define HISTORY_RAW_SIZE 32     //  last 32 readings
+#define HISTORY_MINUTE_SIZE 60  //  last hour in 1 minute buckets
+#define HISTORY_QUARTER_SIZE 48 //  last 12 hours in 15 minute buckets
+
+namespace history
+{
+    enum HISTORY_TIERS
+    {
+        TIER_RAW,
+        TIER_MINUTE,
+        TIER_QUARTER,
+        NUMBER_OF_TIERS
+    };
+
+    extern void AddReading(uint8_t sensor, int16_t raw);
+
+    extern int8_t FindSensor(const char *addressOrIndex);
+    extern int8_t FindTier(const char *tierName);
+    extern bool PrintHistory(uint8_t sensor, uint8_t tier, Print &out);
+
+    extern void setup();
+    extern void loop();
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef LOG_SINKS_H
+#define LOG_SINKS_H
+
+#include "logger.h"
+
+#define SYSLOG_FACILITY 16         //  local0
+#define SYSLOG_MESSAGE_LENGTH 256
+#define BINARY_LOG_MAGIC 0x4C48    //  "HL", little endian
+#define BINARY_LOG_VERSION 1
+#define BINARY_LOG_STRING_LENGTH 64 //  title and data are cut at this length
+#define LOG_SERVER_LOOKUP_TIMEOUT 5000 //  ms to wait for the address of the log server
+#define LOG_SERVER_RETRY_MIN 10        //  s after the first failed lookup, doubled after each one...
+#define LOG_SERVER_RETRY_MAX 600       //  ...up to this
+
+namespace logSinks
+{
+    //  UDP transports next to the MQTT one in logger. Nothing is queued: UDP needs no
+    //  session, an event that cannot be sent right now is counted as failed.
+    extern bool WriteSyslog(const logger::logEvent &event);
+    extern bool WriteBinary(const logger::logEvent &event);
+
+    extern void setup();
+    extern void loop();
+}
+
+#endif
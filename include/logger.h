@@ -2,9 +2,26 @@
 #define LOGGER_H
 
 #include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define LOGGER_RING_SIZE 16        //  records kept until they are published
+#define LOGGER_RECORD_LENGTH 128   //  bytes per preformatted record, longer ones are truncated
+#define LOGGER_BATCH_LENGTH 1024   //  bytes per publish
+#define LOGGER_CATEGORY_BURST 5    //  records a category can log at once...
+#define LOGGER_CATEGORY_REFILL 10  //  ...then one every this many seconds
+#define LOGGER_MAX_SINKS 4
 
 namespace logger
 {
+    enum LOG_LEVELS
+    {
+        LEVEL_DEBUG,
+        LEVEL_INFO,
+        LEVEL_WARNING,
+        LEVEL_ERROR,
+        LEVEL_NONE //  as a sink level: the sink is off
+    };
+
     enum EVENTCATEGORIES
     {
         System,
@@ -35,10 +52,41 @@ namespace logger
         Clock,
         ArchlightRotaryEncoderDirection,
         BoilerDelay,
-        Boiler
+        Boiler,
+        EVENTCATEGORY_COUNT
+    };
+
+    struct logEvent
+    {
+        uint32_t time; //  epoch, 0 if the time is not set yet
+        uint32_t uptimeMs;
+        uint8_t level;
+        uint8_t category;
+        int id;
+        const char *title;
+        const char *data;
     };
 
-    extern void LogEvent(int Category, int ID, String Title, String Data);
+    //  A sink receives every event at or above the level its setting points to
+    struct logSink
+    {
+        const char *name;
+        bool (*write)(const logEvent &event);
+        const uint8_t *minLevel;
+        uint32_t written;
+        uint32_t failed;
+    };
+
+    extern const char *levelNames[];
+
+    extern bool AddSink(const char *name, bool (*write)(const logEvent &event), const uint8_t *minLevel);
+
+    extern void LogEvent(int Category, int ID, const char *Title, const char *Data, LOG_LEVELS Level = LEVEL_INFO);
+    extern void Flush();
+    extern void ToJson(JsonObject obj);
+
+    extern void setup();
+    extern void loop();
 }
 
 #endif
\ No newline at end of file
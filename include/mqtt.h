@@ -5,20 +5,27 @@
 
 #include "network.h"
 
+#define MQTT_BUFFER_SIZE (1024 * 5)
+#define MQTT_SHRUNK_BUFFER_SIZE 3072 //  while memory is low
+
 namespace mqtt
 {
     extern os_timer_t heartbeatTimer;
 
     extern bool needsHeartbeat;
+    extern bool heartbeatSent; //  since the boot or the deep sleep wake
 
     extern PubSubClient PSclient;
     
     extern const char *mqttCustomer;
     extern const char *mqttProject;
 
+    extern char *Topic(char *dest, size_t size, const char *suffix);
     extern void PublishData(const char *topic, const char *payload, bool retained);
 
     extern void ConnectToMQTTBroker();
+    extern void Disconnect();
+    extern void ResizeBuffer();
     extern void SendHeartbeat();
 
     extern void setup();
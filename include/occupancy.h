@@ -0,0 +1,26 @@
+#ifndef OCCUPANCY_H
+#define OCCUPANCY_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+namespace occupancy
+{
+    enum OCCUPANCY_STATES
+    {
+        STATE_VACANT,
+        STATE_PENDING, //  motion seen, waiting for the minimum on time
+        STATE_OCCUPIED
+    };
+
+    extern OCCUPANCY_STATES state;
+
+    extern void MotionStarted(uint32_t captureMillis);
+    extern void MotionEnded(uint32_t captureMillis);
+    extern void ToJson(JsonObject obj);
+
+    extern void setup();
+    extern void loop();
+}
+
+#endif
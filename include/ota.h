@@ -1,10 +1,40 @@
 #ifndef OTA_H
 #define OTA_H
 
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define OTA_CHUNK_SIZE 1024
+#define OTA_STALL_TIMEOUT 10000 //  ms without data before the download is resumed
+#define OTA_MAX_RESUMES 5
+#define OTA_RESUME_DELAY 5000   //  ms, doubled after every resume
+#define OTA_HTTP_TIMEOUT 5000   //  ms
+
 namespace ota
 {
+    enum OTA_STATES
+    {
+        OTA_IDLE,
+        OTA_MANIFEST, //  a check was requested, the manifest is fetched next
+        OTA_DOWNLOADING,
+        OTA_RESUME_WAIT,
+        OTA_RESTARTING,
+        OTA_FAILED
+    };
+
+    extern OTA_STATES state;
+
+    //  Pull update, returns false if one is already under way. The ota task fetches the manifest
+    //  first and the image only when its version differs from the running one, or force is set. Plain HTTP, so any local web server will do:
+    //  {"version":"v1.2.34","size":412016,"sha256":"<64 hex digits>","url":"firmware.bin"}
+    //  A relative url is resolved against the manifest URL. "target":"filesystem" makes it a
+    //  LittleFS image, compared against the version of the last filesystem update.
+    extern bool CheckForUpdate(const char *manifestUrl, bool force);
+    extern void ResolveUrl(const char *baseUrl, const char *url, char *dest, size_t size);
+    extern void ToJson(JsonObject obj);
+
     extern void setup();    
     extern void loop();
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,30 @@
+#ifndef POWER_H
+#define POWER_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <ESP8266WiFi.h>
+
+#define POWER_IDLE_DELAY 20        //  ms the loop rests between passes in modem sleep mode
+#define POWER_MAX_AWAKE 15000      //  ms, a deep sleep wake gives up on the network after this
+#define POWER_CONFIG_WINDOW 120000 //  ms awake after a power-on or reset, to allow configuration and OTA
+#define POWER_CACHED_SENSORS 24    //  filter states kept over deep sleep, the sensors after these start afresh
+
+namespace power
+{
+    enum POWER_MODES
+    {
+        POWER_ALWAYS_ON,   //  radio always on, the loop runs flat out
+        POWER_MODEM_SLEEP, //  radio sleeps between beacons, the loop rests between passes. PIR and hall keep working.
+        POWER_DEEP_SLEEP   //  temperatures only: read, publish, sleep. Needs GPIO16 wired to RST.
+    };
+
+    extern WiFiSleepType_t RadioSleepMode();
+    extern void ToJson(JsonObject obj);
+
+    extern void setup();
+    extern void loop();
+    extern void Idle();
+}
+
+#endif
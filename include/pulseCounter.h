@@ -0,0 +1,21 @@
+#ifndef PULSE_COUNTER_H
+#define PULSE_COUNTER_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define PULSE_WINDOW_SECONDS 60 //  longest sliding window for the rate
+
+namespace pulseCounter
+{
+    extern uint64_t totalPulses;
+
+    extern uint32_t GetMilliHz(uint16_t windowSeconds);
+    extern void ToJson(JsonObject obj);
+    extern void ResetTotal();
+
+    extern void setup();
+    extern void loop();
+}
+
+#endif
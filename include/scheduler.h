@@ -0,0 +1,67 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <Arduino.h>
+
+#ifdef __loopProfiling
+#include <ArduinoJson.h>
+
+#define PROFILE_BUCKETS 6          //  <100 µs, <1 ms, <10 ms, <100 ms, <1 s, >= 1 s
+#define WATCHDOG_NEAR_MISS_MS 1500 //  the software watchdog fires at about 3.2 s without a yield
+#endif
+
+#define SCHEDULER_MAX_TASKS 16
+#define SCHEDULER_PASS_BUDGET_US 20000 //  lower priority tasks wait for the next pass beyond this
+
+namespace scheduler
+{
+    //  Lower value runs first. Critical tasks run even when the pass budget is used up.
+    enum TASK_PRIORITIES
+    {
+        PRIORITY_CRITICAL,
+        PRIORITY_HIGH,
+        PRIORITY_NORMAL,
+        PRIORITY_LOW
+    };
+
+    //  What a task needs to be able to do its work
+    enum TASK_GATES
+    {
+        GATE_NONE,
+        GATE_WIFI,
+        GATE_INTERNET
+    };
+
+    struct task
+    {
+        const char *name;
+        void (*callback)();
+        uint32_t periodMs;
+        uint32_t budgetUs;
+        uint8_t priority;
+        uint8_t gate;
+        uint32_t lastRunMillis;
+        uint32_t runs;
+        uint32_t overruns;
+        uint32_t deferrals;
+        uint32_t minFreeHeap; //  lowest free heap while the task ran
+#ifdef __loopProfiling
+        uint32_t histogram[PROFILE_BUCKETS];
+        uint32_t worstUs;
+        uint64_t totalUs;
+#endif
+    };
+
+    extern task tasks[SCHEDULER_MAX_TASKS];
+    extern uint8_t taskCount;
+
+    extern bool AddTask(const char *name, void (*callback)(), uint32_t periodMs, uint8_t priority, uint32_t budgetUs, uint8_t gate);
+
+#ifdef __loopProfiling
+    extern void ProfileToJson(JsonObject obj, bool detailed);
+#endif
+
+    extern void loop();
+}
+
+#endif
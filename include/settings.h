@@ -23,11 +23,46 @@ namespace settings
 
 #define DEFAULT_HEARTBEAT_INTERVAL 300 //  seconds
 #define DEFAULT_TEMPERATURE_REFRESH_INTERVAL 120
+#define DEFAULT_INTERNET_CHECK_INTERVAL 60 //  seconds
+#define DEFAULT_POWER_MODE 0               //  power::POWER_ALWAYS_ON
+#define DEFAULT_HEAP_LOW_BLOCK 4096        //  bytes, largest free block below this is low memory
+#define DEFAULT_HEAP_ACTION 0              //  heap::HEAP_ACTION_MONITOR, the rest is opt-in
+
+#ifdef __debugSettings
+#define DEFAULT_LOG_MQTT_LEVEL 0 //  logger::LEVEL_DEBUG
+#else
+#define DEFAULT_LOG_MQTT_LEVEL 1 //  logger::LEVEL_INFO
+#endif
+#define DEFAULT_LOG_UDP_LEVEL 4  //  logger::LEVEL_NONE
+#define DEFAULT_LOG_SYSLOG_PORT 514
+#define DEFAULT_LOG_BINARY_PORT 5140
+
+#define DEFAULT_OTA_MANIFEST_URL "http://diy.viktak.com/hall/manifest.json"
+
+#define DEFAULT_FILTER_MEDIAN_WINDOW 3 //  readings
+#define DEFAULT_FILTER_EMA_WEIGHT 128  //  1/256, 256 = no smoothing
+#define DEFAULT_FILTER_MAX_RATE 0      //  1/16 °C per reading, 0 = off
+#define DEFAULT_FILTER_DEADBAND 0      //  1/16 °C, 0 = publish every reading
+
+#define DEFAULT_HALL_DEBOUNCE 200          //  µs, edges closer than this are ignored
+#define DEFAULT_HALL_PULSES_PER_REVOLUTION 1
+#define DEFAULT_HALL_PUBLISH_INTERVAL 60   //  seconds
+#define DEFAULT_HALL_CHANGE_THRESHOLD 10   //  % change of the rate that is published immediately
+
+#define DEFAULT_PIR_HOLD_TIME 60        //  seconds without motion before the area is vacant
+#define DEFAULT_PIR_MIN_ON_TIME 0       //  ms of continuous motion needed to become occupied, 0 = off
+#define DEFAULT_PIR_ROLLUP_INTERVAL 300 //  seconds
 
    //  Saved values
     extern char wifiSSID[22];
     extern char wifiPassword[32];
 
+    //  Empty staticIP means DHCP
+    extern char staticIP[16];
+    extern char staticGateway[16];
+    extern char staticSubnet[16];
+    extern char staticDNS[16];
+
     extern char adminPassword[32];
 
     extern char accessPointPassword[32];
@@ -42,6 +77,33 @@ namespace settings
     extern char mqttTopic[32];
 
     extern int temperatureRefreshInterval;
+    extern uint16_t internetCheckInterval;
+    extern uint8_t powerMode;
+    extern uint16_t heapLowBlock;
+    extern uint8_t heapAction;
+
+    extern uint8_t logMqttLevel;
+    extern uint8_t logSyslogLevel;
+    extern uint8_t logBinaryLevel;
+    extern char logServer[64];
+    extern uint16_t logSyslogPort;
+    extern uint16_t logBinaryPort;
+
+    extern char otaManifestUrl[96];
+
+    extern uint8_t filterMedianWindow;
+    extern uint16_t filterEmaWeight;
+    extern uint16_t filterMaxRate;
+    extern uint16_t filterDeadband;
+
+    extern uint16_t hallDebounce;
+    extern uint16_t hallPulsesPerRevolution;
+    extern uint16_t hallPublishInterval;
+    extern uint8_t hallChangeThreshold;
+
+    extern uint16_t pirHoldTime;
+    extern uint16_t pirMinOnTime;
+    extern uint16_t pirRollupInterval;
 
     //  Calculated values
     extern char localHost[32];
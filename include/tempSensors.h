@@ -3,14 +3,35 @@
 
 #include <OneWire.h>
 #include <DallasTemperature.h>
+#include <ArduinoJson.h>
+
+#define TEMPERATURE_READ_RETRIES 2
+
+#define THERMOMETER_ADDRESS_LENGTH 24 //  "28:FF:..." - 8 hex pairs, 7 separators and the terminator
+#define THERMOMETER_NAME_LENGTH 24
+#define TEMPERATURE_STRING_LENGTH 10  //  the full int16_t range, "-2048.00" .. "2047.94"
+#define TEMPERATURE_INVALID INT16_MIN //  no valid reading yet
+
+struct readStatistics
+{
+    uint32_t goodReads;
+    uint32_t crcErrors;
+    uint32_t disconnects;
+    uint32_t powerOnResets;
+    uint32_t retries;
+    uint32_t failedReads; //  reads that were still bad after all retries
+};
 
 struct thermometer
 {
     DeviceAddress deviceAddress;
-    float measuredTemperatureC;
-    String FriendlyName;
+    char addressHEX[THERMOMETER_ADDRESS_LENGTH];
+    char friendlyName[THERMOMETER_NAME_LENGTH];
+    int16_t rawTemperature;      //  1/16 °C, as read from the scratchpad
+    int16_t filteredTemperature; //  1/16 °C, after the filter stage
     uint8_t resolution;
     bool parasitePowered;
+    readStatistics statistics;
 };
 
 namespace tempSensors
@@ -18,9 +39,15 @@ namespace tempSensors
     extern uint8_t oneWireDevicesCount;
     extern thermometer thermometers[32];
 
-    extern String OneWireDeviceAddress2HEX(DeviceAddress deviceAddress, char Separator);
+    extern void OneWireDeviceAddress2HEX(const DeviceAddress deviceAddress, char Separator, char *dest);
+    extern size_t FormatTemperature(int16_t raw, char *dest);
+    extern void StatisticsToJson(const readStatistics &statistics, JsonObject obj);
+    extern void TotalStatisticsToJson(JsonObject obj);
+    extern void PublishStatistics();
+    extern void ReadTemperatures();
+
     extern void setup();
     extern void loop();
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,27 @@
+#ifndef TIME_SERVICE_H
+#define TIME_SERVICE_H
+
+#include <Arduino.h>
+#include <TimeLib.h>
+
+#define LOCAL_TIME_STRING_LENGTH 20 //  "2024-03-31 02:00:00"
+#define ISO8601_STRING_LENGTH 26    //  "2024-03-31T02:00:00+02:00"
+#define EPOCH_MS_STRING_LENGTH 16   //  "1711846800000"
+
+namespace timeService
+{
+    //  UTC to local conversion is cached: the time zone rules are only evaluated again
+    //  when a DST transition is passed, the time jumps or the time zone setting changes.
+    extern time_t Local();
+    extern time_t ToLocal(time_t utc);
+    extern int32_t Offset();
+    extern const char *ZoneAbbreviation();
+
+    //  Allocation free formatting, dest must hold the matching *_STRING_LENGTH
+    extern char *FormatLocal(char *dest);
+    extern char *FormatIso8601(char *dest);
+    extern uint64_t EpochMs();
+    extern char *FormatEpochMs(uint64_t epochMs, char *dest);
+}
+
+#endif
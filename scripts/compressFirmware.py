@@ -0,0 +1,87 @@
+#   Writes firmware.bin.gz and manifest.json next to firmware.bin after every build, and
+#   littlefs.bin.gz and filesystem.json next to littlefs.bin after every buildfs.
+#
+#   The ESP8266 bootloader (eboot) unpacks gzip images itself, so the compressed file can be
+#   sent through every OTA path: ArduinoOTA, the /update upload and the manifest pull.
+#   Copy both files to the web server the manifest URL points at.
+
+Import("env")
+
+import gzip
+import hashlib
+import json
+import os
+import re
+
+
+def firmware_version():
+    try:
+        with open(os.path.join(env.subst("$PROJECT_INCLUDE_DIR"), "version.h")) as f:
+            match = re.search(r'#define\s+FIRMWARE_VERSION\s+"([^"]+)"', f.read())
+            return match.group(1) if match else "unknown"
+    except OSError:
+        return "unknown"
+
+
+def compress_firmware(source, target, env):
+    firmware = str(target[0])
+    compressed = firmware + ".gz"
+
+    with open(firmware, "rb") as f:
+        raw = f.read()
+
+    #   mtime=0 keeps the output identical for identical firmware
+    with open(compressed, "wb") as f:
+        f.write(gzip.compress(raw, compresslevel=9, mtime=0))
+
+    with open(compressed, "rb") as f:
+        packed = f.read()
+
+    manifest = {
+        "version": firmware_version(),
+        "size": len(packed),
+        "sha256": hashlib.sha256(packed).hexdigest(),
+        "url": os.path.basename(compressed),
+    }
+
+    with open(os.path.join(os.path.dirname(firmware), "manifest.json"), "w") as f:
+        json.dump(manifest, f)
+
+    print("Compressed firmware: %u -> %u bytes (%.0f%%)" % (len(raw), len(packed), 100.0 * len(packed) / len(raw)))
+
+
+def describe_filesystem(source, target, env):
+    image = str(target[0])
+    compressed = image + ".gz"
+
+    with open(image, "rb") as f:
+        raw = f.read()
+
+    #   The image is staged in the free flash (ATOMIC_FS_UPDATE), where a mostly empty
+    #   filesystem only fits compressed. eboot unpacks it while copying it into place.
+    with open(compressed, "wb") as f:
+        f.write(gzip.compress(raw, compresslevel=9, mtime=0))
+
+    with open(compressed, "rb") as f:
+        packed = f.read()
+
+    manifest = {
+        "target": "filesystem",
+        "version": firmware_version(),
+        "size": len(packed),
+        "sha256": hashlib.sha256(packed).hexdigest(),
+        "url": os.path.basename(compressed),
+    }
+
+    with open(os.path.join(os.path.dirname(image), "filesystem.json"), "w") as f:
+        json.dump(manifest, f)
+
+    print("Compressed filesystem: %u -> %u bytes" % (len(raw), len(packed)))
+
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.bin", compress_firmware)
+env.AddPostAction("$BUILD_DIR/littlefs.bin", describe_filesystem)
+
+#   Network uploads send the compressed image
+if env.GetProjectOption("upload_protocol", "") == "espota":
+    env.Replace(UPLOADCMD='"$PYTHONEXE" "$UPLOADER" $UPLOADERFLAGS -f ${SOURCE}.gz')
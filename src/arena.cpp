@@ -0,0 +1,169 @@
+#include <Arduino.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN(n) (((n) + 3) & ~3)
+
+namespace arena
+{
+    uint8_t memory[ARENA_SIZE] __attribute__((aligned(4)));
+    size_t used = 0;
+    size_t last = SIZE_MAX; //  offset of the most recent allocation, SIZE_MAX if it was released
+    size_t peak = 0;
+    uint32_t overflows = 0;
+
+    void *fallbacks[ARENA_MAX_FALLBACKS];
+    uint8_t fallbackCount = 0;
+
+    char blocks[ARENA_BLOCK_COUNT][ARENA_BLOCK_SIZE];
+    uint16_t blocksInUse = 0; //  one bit per block
+    uint8_t blockCount = 0;
+    uint8_t blockPeak = 0;
+    uint32_t blockOverflows = 0;
+
+    bool Owns(void *ptr)
+    {
+        return (uint8_t *)ptr >= memory && (uint8_t *)ptr < memory + ARENA_SIZE;
+    }
+
+    void *Allocate(size_t size)
+    {
+        size = ARENA_ALIGN(size);
+
+        if (size > ARENA_SIZE - used)
+        {
+            overflows++;
+            if (fallbackCount == ARENA_MAX_FALLBACKS)
+                return nullptr;
+
+            void *ptr = malloc(size);
+            if (ptr)
+                fallbacks[fallbackCount++] = ptr;
+            return ptr;
+        }
+
+        last = used;
+        used += size;
+        if (used > peak)
+            peak = used;
+
+        return memory + last;
+    }
+
+    //  ArduinoJson only uses this to shrink a document, which always fits in place
+    void *Reallocate(void *ptr, size_t size)
+    {
+        if (!Owns(ptr))
+        {
+            for (uint8_t i = 0; i < fallbackCount; i++)
+                if (fallbacks[i] == ptr)
+                {
+                    void *resized = realloc(ptr, size);
+                    if (resized)
+                        fallbacks[i] = resized;
+                    return resized;
+                }
+            return nullptr;
+        }
+
+        size_t offset = (uint8_t *)ptr - memory;
+        size = ARENA_ALIGN(size);
+
+        if (offset == last && size <= ARENA_SIZE - offset)
+        {
+            used = offset + size;
+            if (used > peak)
+                peak = used;
+            return ptr;
+        }
+
+        return size <= used - offset ? ptr : nullptr;
+    }
+
+    void Release(void *ptr)
+    {
+        if (!ptr)
+            return;
+
+        if (!Owns(ptr))
+        {
+            for (uint8_t i = 0; i < fallbackCount; i++)
+                if (fallbacks[i] == ptr)
+                {
+                    free(ptr);
+                    memmove(fallbacks + i, fallbacks + i + 1, (fallbackCount - i - 1) * sizeof(void *));
+                    fallbackCount--;
+                    break;
+                }
+            return;
+        }
+
+        size_t offset = (uint8_t *)ptr - memory;
+        if (offset < used)
+            used = offset;
+        last = SIZE_MAX;
+    }
+
+    scope::scope() : mark(used), fallbackMark(fallbackCount)
+    {
+    }
+
+    scope::~scope()
+    {
+        while (fallbackCount > fallbackMark)
+            free(fallbacks[--fallbackCount]);
+
+        if (used > mark)
+        {
+            used = mark;
+            last = SIZE_MAX;
+        }
+    }
+
+    buffer::buffer()
+    {
+        for (block = 0; block < ARENA_BLOCK_COUNT; block++)
+            if (!(blocksInUse & (1 << block)))
+                break;
+
+        if (block == ARENA_BLOCK_COUNT)
+        {
+            block = -1;
+            blockOverflows++;
+            data = (char *)malloc(ARENA_BLOCK_SIZE);
+            if (data)
+                data[0] = 0;
+            return;
+        }
+
+        blocksInUse |= 1 << block;
+        if (++blockCount > blockPeak)
+            blockPeak = blockCount;
+
+        data = blocks[block];
+        data[0] = 0;
+    }
+
+    buffer::~buffer()
+    {
+        if (block < 0)
+        {
+            free(data);
+            return;
+        }
+
+        blocksInUse &= ~(1 << block);
+        blockCount--;
+    }
+
+    void ToJson(JsonObject obj)
+    {
+        obj["Size"] = ARENA_SIZE;
+        obj["Used"] = used;
+        obj["Peak"] = peak;
+        obj["Overflows"] = overflows;
+        obj["Blocks"] = ARENA_BLOCK_COUNT;
+        obj["BlockPeak"] = blockPeak;
+        obj["BlockOverflows"] = blockOverflows;
+    }
+}
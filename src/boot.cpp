@@ -0,0 +1,38 @@
+#include <Arduino.h>
+
+#include "boot.h"
+
+namespace boot
+{
+    //  Set once the timings made it into a heartbeat
+    bool reported = false;
+
+    //  ms since reset, 0 = not reached yet
+    uint32_t phaseMillis[BOOT_PHASE_COUNT];
+
+    const char *phaseNames[BOOT_PHASE_COUNT] = {
+        "Filesystem",
+        "Settings",
+        "Network",
+        "MQTT",
+        "Sensors",
+        "SetupDone",
+        "WiFi",
+        "Internet",
+        "FirstReading",
+        "FirstPublish"};
+
+    //  Only the first time a phase is reached counts
+    void Mark(BOOT_PHASES phase)
+    {
+        if (!phaseMillis[phase])
+            phaseMillis[phase] = max(millis(), 1UL);
+    }
+
+    void ToJson(JsonObject obj)
+    {
+        for (uint8_t i = 0; i < BOOT_PHASE_COUNT; i++)
+            if (phaseMillis[i])
+                obj[phaseNames[i]] = phaseMillis[i];
+    }
+}
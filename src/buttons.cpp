@@ -1,53 +1,173 @@
-#include "Button2.h"
+#include <Arduino.h>
 
-#include "mqtt.h"
+#include "buttons.h"
+#include "occupancy.h"
 
 #define PIR_SENSOR 4
-#define HALL_SENSOR 13
+
+#define EVENT_QUEUE_SIZE 64 //  must be a power of 2
+#define DEBOUNCE_US 50000   //  a level has to be stable this long to count
 
 namespace buttons
 {
+    enum INPUTS
+    {
+        INPUT_PIR,
+        NUMBER_OF_INPUTS
+    };
+
+    struct inputEvent
+    {
+        uint32_t micros;
+        uint8_t input;
+        uint8_t level;
+    };
+
+    //  Debounce state of an input, only touched from the loop
+    struct inputState
+    {
+        uint8_t pin;
+        uint8_t stableLevel;
+        uint8_t pendingLevel;
+        bool pending;
+        uint32_t burstStartMicros; //  first edge after the input was last stable
+        uint32_t lastEdgeMicros;
+    };
+
+    //  Single producer (the GPIO interrupt) / single consumer (the loop) ring buffer
+    volatile inputEvent eventQueue[EVENT_QUEUE_SIZE];
+    volatile uint8_t queueHead = 0;
+    volatile uint8_t queueTail = 0;
+    volatile uint32_t droppedEvents = 0; //  since boot, only the interrupt writes it
+    uint32_t reportedDroppedEvents = 0;
+
+    inputState inputs[NUMBER_OF_INPUTS] = {
+        {PIR_SENSOR, HIGH, HIGH, false, 0, 0}};
+
+    inline void IRAM_ATTR Capture(uint8_t input, uint8_t pin)
+    {
+        uint32_t captureMicros = micros();
+        uint8_t next = (queueHead + 1) & (EVENT_QUEUE_SIZE - 1);
+
+        if (next == queueTail)
+        {
+            droppedEvents++;
+            return;
+        }
+
+        eventQueue[queueHead].micros = captureMicros;
+        eventQueue[queueHead].input = input;
+        eventQueue[queueHead].level = GPIP(pin);
+        queueHead = next;
+    }
 
-    Button2 sensorPIR = Button2(PIR_SENSOR);
-    Button2 sensorHall = Button2(HALL_SENSOR);
+    void IRAM_ATTR PirISR()
+    {
+        Capture(INPUT_PIR, PIR_SENSOR);
+    }
 
-    void ButtonPressedHandler(Button2 &btn)
+    //  millis() value at the time a captured edge happened
+    uint32_t CaptureTimeToMillis(uint32_t captureMicros)
     {
-        if (btn == sensorPIR)
+        return millis() - (micros() - captureMicros) / 1000;
+    }
+
+    //  Inputs use pull-ups, so "pressed" is the LOW level. The PIR output is
+    //  active high: LOW means no motion.
+    void ButtonPressedHandler(uint8_t input, uint32_t captureMicros)
+    {
+        if (input == INPUT_PIR)
         {
-            mqtt::PublishData(((String)("PIR0")).c_str(), ((String)"off").c_str(), true);
+            occupancy::MotionEnded(CaptureTimeToMillis(captureMicros));
         }
-        else if (btn == sensorHall)
+    }
+
+    void ButtonReleasedHandler(uint8_t input, uint32_t captureMicros)
+    {
+        if (input == INPUT_PIR)
         {
-            // Serial.println("sensorHall: Pressed");
+            occupancy::MotionStarted(CaptureTimeToMillis(captureMicros));
         }
     }
 
-    void ButtonReleasedHandler(Button2 &btn)
+    void ProcessQueue()
     {
-        if (btn == sensorPIR)
+        while (queueTail != queueHead)
         {
-            mqtt::PublishData(((String)("PIR0")).c_str(), ((String)"on").c_str(), true);
+            inputEvent e;
+            e.micros = eventQueue[queueTail].micros;
+            e.input = eventQueue[queueTail].input;
+            e.level = eventQueue[queueTail].level;
+            queueTail = (queueTail + 1) & (EVENT_QUEUE_SIZE - 1);
+
+            inputState &s = inputs[e.input];
+
+            if (!s.pending)
+                s.burstStartMicros = e.micros;
+
+            s.pending = true;
+            s.pendingLevel = e.level;
+            s.lastEdgeMicros = e.micros;
         }
-        else if (btn == sensorHall)
+    }
+
+    //  A transition is accepted once the input has been quiet for DEBOUNCE_US and is
+    //  reported with the time of the first edge of the burst, not the time it was processed.
+    void Debounce()
+    {
+        uint32_t nowMicros = micros();
+
+        for (uint8_t i = 0; i < NUMBER_OF_INPUTS; i++)
         {
-            // Serial.print("sensorHall: Released after ");
-            // Serial.println(btn.wasPressedFor());
+            inputState &s = inputs[i];
+
+            if (!s.pending || nowMicros - s.lastEdgeMicros < DEBOUNCE_US)
+                continue;
+
+            s.pending = false;
+
+            if (s.pendingLevel == s.stableLevel)
+                continue;
+
+            s.stableLevel = s.pendingLevel;
+
+            if (s.stableLevel == LOW)
+                ButtonPressedHandler(i, s.burstStartMicros);
+            else
+                ButtonReleasedHandler(i, s.burstStartMicros);
         }
     }
+
     void setup()
     {
-        sensorPIR.setPressedHandler(ButtonPressedHandler);
-        sensorPIR.setReleasedHandler(ButtonReleasedHandler);
+        for (uint8_t i = 0; i < NUMBER_OF_INPUTS; i++)
+        {
+            pinMode(inputs[i].pin, INPUT_PULLUP);
+            inputs[i].stableLevel = digitalRead(inputs[i].pin);
+            inputs[i].pendingLevel = inputs[i].stableLevel;
+        }
 
-        sensorHall.setPressedHandler(ButtonPressedHandler);
-        sensorHall.setReleasedHandler(ButtonReleasedHandler);
+        attachInterrupt(digitalPinToInterrupt(PIR_SENSOR), PirISR, CHANGE);
     }
 
     void loop()
     {
-        sensorPIR.loop();
-        sensorHall.loop();
+        ProcessQueue();
+        Debounce();
+
+        uint32_t dropped = droppedEvents;
+        if (dropped != reportedDroppedEvents)
+        {
+#ifdef __debugSettings
+            Serial.printf_P(PSTR("Input event queue overflow, %u event(s) dropped.\r\n"), dropped - reportedDroppedEvents);
+#endif
+            reportedDroppedEvents = dropped;
+        }
+    }
+
+    void ToJson(JsonObject obj)
+    {
+        obj["DroppedEvents"] = droppedEvents;
     }
 
-}
\ No newline at end of file
+}
@@ -2,21 +2,22 @@
 #include <ESP8266WiFi.h>
 
 #include "common.h"
-#include "timechangerules.h"
+#include "timeService.h"
 #include "settings.h"
 
 namespace common
 {
-    TimeChangeRule *tcr;
+    const char HARDWARE_ID[] PROGMEM = "hall sensors";
+    const char HARDWARE_VERSION[] PROGMEM = "1.0";
+    const char FIRMWARE_ID[] PROGMEM = "hall";
 
     //   !  For "strftime" to work delete Time.h file in TimeLib library  !!!
-    char *GetFullDateTime(const char *formattingString, size_t size)
+    char *GetFullDateTime(const char *formattingString, char *dest, size_t size)
     {
-        time_t localTime = timechangerules::timezones[settings::timeZone]->toLocal(now(), &tcr);
-        struct tm *now = localtime(&localTime);
-        char *buf = new char[20];
-        strftime(buf, 20, formattingString, now);
-        return buf;
+        time_t localTime = timeService::Local();
+        struct tm *now = gmtime(&localTime);
+        strftime(dest, size, formattingString, now);
+        return dest;
     }
 
     void SetRandomSeed()
@@ -52,6 +53,26 @@ namespace common
         return (String)tmp;
     }
 
+    //  printf on the ESP8266 has no 64-bit support, dest must hold 21 bytes
+    char *Uint64ToString(uint64_t value, char *dest)
+    {
+        char digits[20];
+        uint8_t n = 0;
+
+        do
+        {
+            digits[n++] = '0' + value % 10;
+            value /= 10;
+        } while (value);
+
+        char *p = dest;
+        while (n)
+            *p++ = digits[--n];
+        *p = 0;
+
+        return dest;
+    }
+
     String GetDeviceMAC()
     {
         String s = WiFi.macAddress();
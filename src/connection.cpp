@@ -1,203 +1,561 @@
 #include <Arduino.h>
 #include <ESP8266WiFi.h>
+#include <TimeLib.h>
+#include <LittleFS.h>
+#include <lwip/dns.h>
+#include <lwip/dhcp.h>
+#include <lwip/netif.h>
 
+#include "connection.h"
 #include "ntp.h"
 #include "settings.h"
 #include "network.h"
 #include "mqtt.h"
-#include "ota.h"
 #include "leds.h"
-#include "tempSensors.h"
-#include "buttons.h"
-
-#define MAX_WIFI_INACTIVITY 300
-#define WIFI_CONNECTION_TIMEOUT 10
-#define ACCESS_POINT_TIMEOUT 300000
+#include "power.h"
+#include "boot.h"
+#include "logger.h"
+
+#define WIFI_CONNECTION_TIMEOUT 10000 //  ms per connection attempt
+#define WIFI_FAILURES_BEFORE_AP 3     //  failed attempts before the access point is opened
+#define WIFI_BACKOFF_BASE 2000        //  ms, doubled after every failed attempt...
+#define WIFI_BACKOFF_MAX 300000       //  ...up to this
+#define WIFI_FAST_CONNECT_TIMEOUT 3000 //  ms for a directed connection with the cached BSSID/channel
+#define INTERNET_RETRY_INTERVAL 10    //  seconds between checks while the Internet is down
+#define INTERNET_CHECK_TIMEOUT 5000   //  ms to wait for a DNS answer
+#define INTERNET_MIN_CHECK_GAP 5000   //  ms, failure reports cannot trigger checks faster than this
+#define WIFI_LEASE_MAX_REUSE 86400    //  s, a cached lease is never reused for longer, even if the server allows it
+
+#define WIFI_CACHE_FILE "/wifi.bin"
+#define WIFI_CACHE_MAGIC 0x57494649
+
+#define LED_BLINK_PERIOD 1000
+#define LED_BLINK_ON_TIME 50
 
 namespace connection
 {
     bool ntpInitialized = false;
     bool isAccessPoint = false;
-    bool isAccessPointCreated = false;
-    bool needsRestart = false;
 
-    const char *ntpServerName = "diy.viktak.com";
+    //  Read by the scheduler to gate network dependent tasks
+    bool isWiFiConnected = false;
+    bool isInternetConnected = false;
 
-    os_timer_t accessPointTimer;
+    const char *ntpServerName = "diy.viktak.com";
 
-    void accessPointTimerCallback(void *pArg)
+    //  Set from the WiFi event callbacks, handled in the loop
+    bool stationGotIP = false;
+    bool stationDisconnected = false;
+    uint8_t lastDisconnectReason = 0;
+
+    WiFiEventHandler gotIPHandler;
+    WiFiEventHandler disconnectedHandler;
+
+    uint8_t failedAttempts = 0;
+    uint32_t stateStartMillis = 0;
+    uint32_t backoffMillis = 0;
+    uint32_t lastInternetCheckMillis = 0;
+
+    //  Connectivity monitor. The DNS lookup runs asynchronously in lwIP and the
+    //  result is kept until the next check.
+    bool checkPending = false;
+    bool checkRequested = false;
+    volatile bool dnsAnswered = false;
+    volatile bool dnsResolved = false;
+    uint32_t checkGeneration = 0;
+    uint32_t internetChecks = 0;
+    uint32_t internetFailures = 0;
+    uint32_t internetUpMillis = 0;
+    uint32_t internetDownMillis = 0;
+
+    //  Last good access point and DHCP lease. Kept in RTC memory over a restart and in
+    //  flash over power loss. Must fit the 10 blocks reserved at RTC_WIFI_CACHE.
+    struct wifiCache
     {
-        ESP.reset();
-    }
+        uint32_t magic;
+        uint32_t ssidHash; //  the cache belongs to this network only
+        uint8_t bssid[6];
+        uint8_t channel;
+        uint8_t hasLease;
+        uint32_t ip;
+        uint32_t gateway;
+        uint32_t subnet;
+        uint32_t dns;
+        uint32_t leaseUntil; //  epoch, the lease is reused until its renewal time (T1), 0 = unknown
+        uint32_t checksum;
+    } cache;
+
+    static_assert(sizeof(wifiCache) <= (common::RTC_POWER - common::RTC_WIFI_CACHE) * 4, "wifiCache overlaps RTC_POWER");
+
+    bool cacheValid = false;
+    bool leaseValid = false; //  only a lease from RTC memory is recent enough to reuse
+    bool usingCachedLease = false;
+    bool fastConnect = false;
 
     enum CONNECTION_STATE
     {
-        STATE_CHECK_WIFI_CONNECTION,
-        STATE_WIFI_CONNECT,
-        STATE_CHECK_INTERNET_CONNECTION,
-        STATE_INTERNET_CONNECTED
+        STATE_WIFI_START,
+        STATE_WIFI_CONNECTING,
+        STATE_WIFI_BACKOFF,
+        STATE_WIFI_CONNECTED
     } connectionState;
 
-    boolean checkInternetConnection()
+    void DnsFoundCallback(const char *name, const ip_addr_t *ipaddr, void *arg)
     {
-        IPAddress timeServerIP;
-        int result = WiFi.hostByName(ntpServerName, timeServerIP);
-        return (result == 1);
+        //  Answers to a check that already timed out are ignored
+        if ((uint32_t)arg != checkGeneration)
+            return;
+
+        dnsResolved = ipaddr != nullptr;
+        dnsAnswered = true;
     }
 
-    void setup()
+    //  Returns true when the answer is already known (from the lwIP cache or an error)
+    bool StartInternetCheck()
     {
+        ip_addr_t address;
+
+        checkGeneration++;
+        dnsAnswered = false;
+        lastInternetCheckMillis = millis();
+        internetChecks++;
+
+        err_t result = dns_gethostbyname(ntpServerName, &address, DnsFoundCallback, (void *)checkGeneration);
+
+        if (result == ERR_INPROGRESS)
+        {
+            checkPending = true;
+            return false;
+        }
+
+        dnsResolved = result == ERR_OK;
+        dnsAnswered = true;
+        return true;
     }
 
-    void loop()
+    void ReportFailure()
     {
-        if (isAccessPoint)
-        {
-            if (!isAccessPointCreated)
-            {
-                Serial.printf("Could not connect to %s.\r\nReverting to Access Point mode.\r\n", settings::wifiSSID);
+        checkRequested = true;
+    }
+
+    uint32_t Hash(const uint8_t *data, size_t length)
+    {
+        uint32_t hash = 2166136261UL; //  FNV-1a
+        while (length--)
+            hash = (hash ^ *data++) * 16777619UL;
+        return hash;
+    }
 
-                delay(500);
-                WiFi.mode(WIFI_AP);
-                WiFi.softAP(settings::localHost, settings::accessPointPassword);
+    uint32_t CacheChecksum(const wifiCache &c)
+    {
+        return Hash((const uint8_t *)&c, offsetof(wifiCache, checksum));
+    }
 
-                IPAddress myIP = WiFi.softAPIP();
-                isAccessPointCreated = true;
+    bool CheckCache(const wifiCache &c)
+    {
+        return c.magic == WIFI_CACHE_MAGIC &&
+               c.checksum == CacheChecksum(c) &&
+               c.ssidHash == Hash((const uint8_t *)settings::wifiSSID, strlen(settings::wifiSSID)) &&
+               c.channel >= 1 && c.channel <= 14;
+    }
 
-                network::InitWifiWebServer();
+    void LoadCache()
+    {
+        ESP.rtcUserMemoryRead(common::RTC_WIFI_CACHE, (uint32_t *)&cache, sizeof(cache));
+        if (CheckCache(cache))
+        {
+            cacheValid = true;
+            leaseValid = cache.hasLease;
+            return;
+        }
 
-                Serial.println("Access point created. Use the following information to connect to the ESP device, then follow the on-screen instructions to connect to a different wifi network:");
+        File f = LittleFS.open(WIFI_CACHE_FILE, "r");
+        if (f)
+        {
+            cacheValid = f.read((uint8_t *)&cache, sizeof(cache)) == sizeof(cache) && CheckCache(cache);
+            f.close();
+        }
+        leaseValid = false;
+    }
 
-                Serial.print("SSID:\t\t\t");
-                Serial.println(settings::localHost);
+    //  Seconds until the DHCP lease is due for renewal, 0 if the address did not come from DHCP
+    uint32_t LeaseRenewSeconds()
+    {
+        struct netif *station = netif_default;
+        if (!station || !dhcp_supplied_address(station))
+            return 0;
 
-                Serial.print("Password:\t\t");
-                Serial.println(settings::accessPointPassword);
+        struct dhcp *dhcp = netif_dhcp_data(station);
+        uint32_t seconds = dhcp->offered_t1_renew ? dhcp->offered_t1_renew : dhcp->offered_t0_lease / 2;
+        return min(seconds, (uint32_t)WIFI_LEASE_MAX_REUSE);
+    }
+
+    //  A reused lease does not talk to the DHCP server, so it is only taken while the server
+    //  would not even expect a renewal yet. Without a clock there is no telling.
+    bool LeaseUsable()
+    {
+        return leaseValid && cache.leaseUntil && timeStatus() != timeNotSet && (uint32_t)now() < cache.leaseUntil;
+    }
+
+    //  RTC memory is written on every connection, the file only when the access point changes
+    void SaveCache()
+    {
+        wifiCache c;
+        memset(&c, 0, sizeof(c));
+
+        c.magic = WIFI_CACHE_MAGIC;
+        c.ssidHash = Hash((const uint8_t *)settings::wifiSSID, strlen(settings::wifiSSID));
+        memcpy(c.bssid, WiFi.BSSID(), sizeof(c.bssid));
+        c.channel = WiFi.channel();
+        c.hasLease = settings::staticIP[0] == 0;
+        c.ip = WiFi.localIP();
+        c.gateway = WiFi.gatewayIP();
+        c.subnet = WiFi.subnetMask();
+        c.dns = WiFi.dnsIP();
+
+        //  A reused lease keeps its original deadline, only DHCP extends it
+        if (usingCachedLease)
+            c.leaseUntil = cache.leaseUntil;
+        else if (c.hasLease && timeStatus() != timeNotSet)
+        {
+            uint32_t renewSeconds = LeaseRenewSeconds();
+            c.leaseUntil = renewSeconds ? now() + renewSeconds : 0;
+        }
+        c.checksum = CacheChecksum(c);
 
-                Serial.print("Access point address:\t");
-                Serial.println(myIP);
+        ESP.rtcUserMemoryWrite(common::RTC_WIFI_CACHE, (uint32_t *)&c, sizeof(c));
 
-                //  Timers/interrupts
-                os_timer_setfn(&accessPointTimer, accessPointTimerCallback, NULL);
-                os_timer_arm(&accessPointTimer, ACCESS_POINT_TIMEOUT, true);
-                os_timer_disarm(&mqtt::heartbeatTimer);
+        bool apChanged = !cacheValid || c.channel != cache.channel || memcmp(c.bssid, cache.bssid, sizeof(c.bssid)) != 0;
+        if (apChanged)
+        {
+            File f = LittleFS.open(WIFI_CACHE_FILE, "w");
+            if (f)
+            {
+                f.write((uint8_t *)&c, sizeof(c));
+                f.close();
             }
+            else
+                Serial.println(F("Failed to open WiFi cache file for writing"));
         }
+
+        cache = c;
+        cacheValid = true;
+        leaseValid = c.hasLease;
+    }
+
+    void InvalidateCache()
+    {
+        cache.magic = 0;
+        ESP.rtcUserMemoryWrite(common::RTC_WIFI_CACHE, (uint32_t *)&cache, sizeof(cache));
+        LittleFS.remove(WIFI_CACHE_FILE);
+
+        cacheValid = false;
+        leaseValid = false;
+    }
+
+    //  A static configuration wins, then a lease kept over a restart, otherwise DHCP
+    void ConfigureAddress()
+    {
+        IPAddress ip, gateway, subnet, dns;
+
+        usingCachedLease = false;
+
+        if (settings::staticIP[0] &&
+            ip.fromString(settings::staticIP) &&
+            gateway.fromString(settings::staticGateway) &&
+            subnet.fromString(settings::staticSubnet))
+        {
+            if (!dns.fromString(settings::staticDNS))
+                dns = gateway;
+            WiFi.config(ip, gateway, subnet, dns);
+        }
+        else if (fastConnect && LeaseUsable())
+        {
+            usingCachedLease = true;
+            WiFi.config(IPAddress(cache.ip), IPAddress(cache.gateway), IPAddress(cache.subnet), IPAddress(cache.dns));
+        }
+        else
+            WiFi.config(IPAddress(0, 0, 0, 0), IPAddress(0, 0, 0, 0), IPAddress(0, 0, 0, 0));
+    }
+
+    void SetState(CONNECTION_STATE state)
+    {
+        connectionState = state;
+        stateStartMillis = millis();
+    }
+
+    void BlinkConnectionLED()
+    {
+        if ((millis() - stateStartMillis) % LED_BLINK_PERIOD < LED_BLINK_ON_TIME)
+            leds::connectionLED_ON();
+        else
+            leds::connectionLED_OFF();
+    }
+
+    //  The access point runs next to the station, so connection attempts continue in the background
+    void StartAccessPoint()
+    {
+        Serial.printf_P(PSTR("Could not connect to %s.\r\nOpening Access Point, still retrying in the background.\r\n"), settings::wifiSSID);
+
+        WiFi.mode(WIFI_AP_STA);
+        WiFi.softAP(settings::localHost, settings::accessPointPassword);
+        isAccessPoint = true;
+
+        Serial.println(F("Access point created. Use the following information to connect to the ESP device, then follow the on-screen instructions to connect to a different wifi network:"));
+
+        Serial.print(F("SSID:\t\t\t"));
+        Serial.println(settings::localHost);
+
+        Serial.print(F("Password:\t\t"));
+        Serial.println(settings::accessPointPassword);
+
+        Serial.print(F("Access point address:\t"));
+        Serial.println(WiFi.softAPIP());
+    }
+
+    void StopAccessPoint()
+    {
+        WiFi.softAPdisconnect(true);
+        WiFi.mode(WIFI_STA);
+        isAccessPoint = false;
+
+        Serial.println(F("Access point closed."));
+    }
+
+    void StartStation()
+    {
+        if (!isAccessPoint)
+            WiFi.mode(WIFI_STA);
+
+        WiFi.hostname(settings::localHost); //  so that it shows up coorectly in DHCP/DNS on the router
+
+        //  The first attempt goes straight to the last known access point, skipping the scan
+        fastConnect = cacheValid && failedAttempts == 0;
+        ConfigureAddress();
+
+        if (fastConnect)
+            WiFi.begin(settings::wifiSSID, settings::wifiPassword, cache.channel, cache.bssid, true);
         else
+            WiFi.begin(settings::wifiSSID, settings::wifiPassword);
+        WiFi.setSleepMode(power::RadioSleepMode());
+
+        stationGotIP = false;
+        Serial.printf_P(PSTR("Trying to connect to WIFI network: %s%s\r\n"), settings::wifiSSID, fastConnect ? " (fast connect)" : "");
+    }
+
+    void ConnectionFailed()
+    {
+        //  The access point moved or the lease is gone: forget them and do a full scan right away
+        if (fastConnect)
         {
-            switch (connectionState)
-            {
+            Serial.println(F("Fast connect failed, falling back to a full scan."));
+
+            WiFi.disconnect();
+            InvalidateCache();
+            SetState(STATE_WIFI_START);
+            return;
+        }
+
+        //  Saturates, a wrap would turn the fast connect back on and break the backoff
+        if (failedAttempts < UINT8_MAX)
+            failedAttempts++;
+        WiFi.disconnect();
+
+        Serial.printf_P(PSTR("Could not connect to WiFi (attempt %u, reason %u).\r\n"), failedAttempts, lastDisconnectReason);
+
+        if (failedAttempts >= WIFI_FAILURES_BEFORE_AP && !isAccessPoint)
+            StartAccessPoint();
+
+        backoffMillis = WIFI_BACKOFF_BASE << (constrain(failedAttempts, 1, 9) - 1);
+        if (backoffMillis > WIFI_BACKOFF_MAX)
+            backoffMillis = WIFI_BACKOFF_MAX;
+
+        leds::connectionLED_OFF();
+        SetState(STATE_WIFI_BACKOFF);
+    }
+
+    void Connected()
+    {
+        failedAttempts = 0;
+        isWiFiConnected = true;
+        checkRequested = true;
+        lastInternetCheckMillis = millis() - INTERNET_MIN_CHECK_GAP;
+
+        if (isAccessPoint)
+            StopAccessPoint();
+
+        leds::connectionLED_ON();
+
+        SaveCache();
+        boot::Mark(boot::BOOT_WIFI);
 
-            // Check the WiFi connection
-            case STATE_CHECK_WIFI_CONNECTION:
+        Serial.printf_P(PSTR("Connected to WiFi in %u ms.\r\n"), millis() - stateStartMillis);
+        Serial.printf_P(PSTR("WiFi channel:\t%u\r\n"), WiFi.channel());
+        Serial.printf_P(PSTR("IP address:\t%s\r\n"), WiFi.localIP().toString().c_str());
+
+        SetState(STATE_WIFI_CONNECTED);
+    }
+
+    void InternetStateChanged(bool up)
+    {
+        if (up)
+        {
+            if (!ntpInitialized)
             {
-                // Are we connected ?
-                if (WiFi.status() != WL_CONNECTED)
-                {
-                    // Wifi is NOT connected
-                    leds::connectionLED_OFF();
-                    connectionState = STATE_WIFI_CONNECT;
-                }
-                else
-                {
-                    // Wifi is connected so check Internet
-                    leds::connectionLED_ON();
-                    connectionState = STATE_CHECK_INTERNET_CONNECTION;
-                }
-                break;
+                // We are connected to the Internet for the first time so set NTP provider
+                ntp::setup();
+
+                ntpInitialized = true;
             }
 
-            // No Wifi so attempt WiFi connection
-            case STATE_WIFI_CONNECT:
+            internetUpMillis = millis();
+            boot::Mark(boot::BOOT_INTERNET);
+            Serial.println(F("Connected to the Internet."));
+            logger::LogEvent(logger::Conn, 1, "Internet up", WiFi.localIP().toString().c_str());
+            leds::connectionLED_OFF();
+        }
+        else
+        {
+            internetDownMillis = millis();
+            internetFailures++;
+            Serial.println(F("Internet connection lost."));
+            logger::LogEvent(logger::Conn, 3, "Internet lost", ntpServerName, logger::LEVEL_WARNING);
+            leds::connectionLED_ON();
+        }
+
+        isInternetConnected = up;
+    }
+
+    //  Checks every internetCheckInterval seconds (more often while down), or early when
+    //  MQTT or NTP report a failure. Never waits for the answer.
+    void CheckInternet()
+    {
+        if (!checkPending)
+        {
+            uint32_t interval = (isInternetConnected ? settings::internetCheckInterval : INTERNET_RETRY_INTERVAL) * 1000UL;
+            uint32_t sinceLastCheck = millis() - lastInternetCheckMillis;
+
+            bool due = sinceLastCheck >= interval || (checkRequested && sinceLastCheck >= INTERNET_MIN_CHECK_GAP);
+            if (!due)
+                return;
+
+            checkRequested = false;
+            if (!StartInternetCheck())
+                return;
+        }
+        else if (!dnsAnswered)
+        {
+            if (millis() - lastInternetCheckMillis < INTERNET_CHECK_TIMEOUT)
+                return;
+
+            checkGeneration++;
+            dnsResolved = false;
+        }
+
+        checkPending = false;
+
+        if (dnsResolved != isInternetConnected)
+            InternetStateChanged(dnsResolved);
+    }
+
+    uint32_t MillisToEpoch(uint32_t eventMillis)
+    {
+        return eventMillis ? now() - (millis() - eventMillis) / 1000 : 0;
+    }
+
+    void ToJson(JsonObject obj)
+    {
+        obj["WiFi"] = isWiFiConnected ? "up" : "down";
+        obj["Internet"] = isInternetConnected ? "up" : "down";
+        obj["UpSince"] = MillisToEpoch(internetUpMillis);
+        obj["DownSince"] = MillisToEpoch(internetDownMillis);
+        obj["LastCheckAge"] = (millis() - lastInternetCheckMillis) / 1000;
+        obj["Checks"] = internetChecks;
+        obj["Failures"] = internetFailures;
+        obj["LastDisconnectReason"] = lastDisconnectReason;
+    }
+
+    void setup()
+    {
+        gotIPHandler = WiFi.onStationModeGotIP([](const WiFiEventStationModeGotIP &event)
+                                               { stationGotIP = true; });
+
+        disconnectedHandler = WiFi.onStationModeDisconnected([](const WiFiEventStationModeDisconnected &event)
+                                                             {
+                                                                 stationDisconnected = true;
+                                                                 lastDisconnectReason = event.reason; });
+
+        //  The cache is kept by this module, the SDK must not write the credentials to flash on every begin()
+        WiFi.persistent(false);
+        LoadCache();
+
+        SetState(STATE_WIFI_START);
+    }
+
+    //  Never blocks: every state only checks its condition and returns
+    void loop()
+    {
+        if (stationDisconnected)
+        {
+            stationDisconnected = false;
+
+            if (connectionState == STATE_WIFI_CONNECTED)
             {
-                // Indicate NTP no yet initialized
+                Serial.printf_P(PSTR("WiFi connection lost (reason %u).\r\n"), lastDisconnectReason);
+
+                char reason[4];
+                sprintf(reason, "%u", lastDisconnectReason);
+                logger::LogEvent(logger::Conn, 2, "WiFi lost", reason, logger::LEVEL_WARNING);
+
+                isWiFiConnected = false;
+                if (isInternetConnected)
+                    InternetStateChanged(false);
+                checkPending = false;
                 ntpInitialized = false;
                 leds::connectionLED_OFF();
-                Serial.printf("Trying to connect to WIFI network: %s", settings::wifiSSID);
-
-                // Set station mode
-                WiFi.mode(WIFI_STA);
-
-                // Start connection process
-                WiFi.hostname(settings::localHost); //  so that it shows up coorectly in DHCP/DNS on the router
-                WiFi.begin(settings::wifiSSID, settings::wifiPassword);
-                WiFi.setSleep(false);
-
-                // Initialize iteration counter
-                uint8_t attempt = 0;
-
-                while ((WiFi.status() != WL_CONNECTED) && (attempt++ < WIFI_CONNECTION_TIMEOUT))
-                {
-                    leds::connectionLED_ON();
-                    Serial.print(".");
-                    delay(50);
-                    leds::connectionLED_OFF();
-                    delay(950);
-                }
-                if (attempt >= WIFI_CONNECTION_TIMEOUT)
-                {
-                    Serial.println();
-                    Serial.println("Could not connect to WiFi.");
-                    delay(100);
-
-                    isAccessPoint = true;
-
-                    break;
-                }
-                leds::connectionLED_ON();
-
-                Serial.println(" Success!");
-
-                IPAddress ip = WiFi.localIP();
-
-                Serial.printf("WiFi channel:\t%u\r\n", WiFi.channel());
-                Serial.printf("IP address:\t%s\r\n", ip.toString().c_str());
-                connectionState = STATE_CHECK_INTERNET_CONNECTION;
-                break;
+                SetState(STATE_WIFI_START);
             }
+            //  The attempt failed before its timeout (no such network, wrong password...).
+            //  WiFi.begin() leaving the previous access point reports ASSOC_LEAVE, that is not one.
+            else if (connectionState == STATE_WIFI_CONNECTING && lastDisconnectReason != WIFI_DISCONNECT_REASON_ASSOC_LEAVE)
+                ConnectionFailed();
+        }
 
-            case STATE_CHECK_INTERNET_CONNECTION:
+        switch (connectionState)
+        {
+        case STATE_WIFI_START:
+            StartStation();
+            SetState(STATE_WIFI_CONNECTING);
+            break;
+
+        case STATE_WIFI_CONNECTING:
+            if (stationGotIP)
+                Connected();
+            else if (millis() - stateStartMillis > (fastConnect ? WIFI_FAST_CONNECT_TIMEOUT : WIFI_CONNECTION_TIMEOUT))
+                ConnectionFailed();
+            else
+                BlinkConnectionLED();
+            break;
+
+        case STATE_WIFI_BACKOFF:
+            if (millis() - stateStartMillis > backoffMillis)
+                SetState(STATE_WIFI_START);
+            break;
+
+        case STATE_WIFI_CONNECTED:
+            //  A reused lease that reaches its renewal time is given back to DHCP by reconnecting
+            if (usingCachedLease && !LeaseUsable())
             {
-                // Do we have a connection to the Internet ?
-                if (checkInternetConnection())
-                {
-                    // We have an Internet connection
-                    if (!ntpInitialized)
-                    {
-                        // We are connected to the Internet for the first time so set NTP provider
-                        ntp::setup();
-
-                        ntpInitialized = true;
-
-                        Serial.println("Connected to the Internet.");
-                    }
-
-                    connectionState = STATE_INTERNET_CONNECTED;
-                    leds::connectionLED_OFF();
-                }
-                else
-                {
-                    connectionState = STATE_CHECK_WIFI_CONNECTION;
-                    leds::connectionLED_ON();
-                }
+                Serial.println(F("Cached DHCP lease is due for renewal, reconnecting with DHCP."));
+                leaseValid = false;
+                usingCachedLease = false;
+                WiFi.disconnect();
                 break;
             }
 
-            case STATE_INTERNET_CONNECTED:
-            {
-                ota::loop();
-                mqtt::loop();
-                tempSensors::loop();
-                buttons::loop();
-                ntp::loop();
-
-                // Set next connection state
-                connectionState = STATE_CHECK_WIFI_CONNECTION;
-                break;
-            }
-            }
+            CheckInternet();
+            break;
         }
-        network::loop();
     }
 
 }
@@ -0,0 +1,410 @@
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <TimeLib.h>
+
+#include "datalog.h"
+#include "tempSensors.h"
+#include "mqtt.h"
+
+#define DATALOG_DIRECTORY "/log"
+#define DATALOG_MAGIC 0x31535448 //  "HTS1"
+#define DATALOG_HEADER_SIZE 8    //  magic + segment base time
+#define DATALOG_MAX_RECORD_SIZE 9 //  channel + 5 byte time delta + 3 byte value delta
+#define DATALOG_BACKFILL_BATCH 32
+
+//  Segment layout: uint32 magic, uint32 base time (epoch), then records of
+//  uint8 channel, varint time delta (s) from the previous record and zigzag
+//  varint value delta from the previous value of the same channel. The delta
+//  state restarts with every segment so each one can be decoded on its own.
+
+namespace datalog
+{
+    uint32_t firstSegment = 0;
+    uint32_t currentSegment = 0;
+    uint32_t segmentBytes = 0;
+
+    uint32_t lastTime;
+    int16_t previousValues[DATALOG_CHANNELS];
+
+    uint8_t buffer[DATALOG_BUFFER_SIZE];
+    size_t bufferLength = 0;
+    unsigned long lastFlushMillis = 0;
+
+    bool resumePending = false;
+    logState resumeState;
+
+    bool backfillActive = false;
+    uint32_t backfillSince;
+    logCursor backfillCursor;
+
+    void SegmentFileName(uint32_t segment, char *dest)
+    {
+        sprintf(dest, DATALOG_DIRECTORY "/%05u.bin", segment);
+    }
+
+    size_t WriteVarint(uint8_t *dest, uint32_t value)
+    {
+        size_t n = 0;
+        while (value >= 0x80)
+        {
+            dest[n++] = (value & 0x7F) | 0x80;
+            value >>= 7;
+        }
+        dest[n++] = value;
+        return n;
+    }
+
+    bool ReadVarint(File &f, uint32_t &value)
+    {
+        value = 0;
+        for (uint8_t shift = 0; shift < 35; shift += 7)
+        {
+            int b = f.read();
+            if (b < 0)
+                return false;
+            value |= (uint32_t)(b & 0x7F) << shift;
+            if (!(b & 0x80))
+                return true;
+        }
+        return false;
+    }
+
+    void Flush()
+    {
+        if (bufferLength == 0)
+            return;
+
+        char fileName[20];
+        SegmentFileName(currentSegment, fileName);
+
+        File f = LittleFS.open(fileName, "a");
+        if (f)
+        {
+            f.write(buffer, bufferLength);
+            f.close();
+        }
+        else
+        {
+            Serial.println(F("Error: Failed to write data log."));
+        }
+
+        bufferLength = 0;
+        lastFlushMillis = millis();
+    }
+
+    void StartSegment()
+    {
+        Flush();
+
+        currentSegment++;
+        if (firstSegment == 0)
+            firstSegment = currentSegment;
+
+        while (currentSegment - firstSegment + 1 > DATALOG_MAX_SEGMENTS)
+        {
+            char fileName[20];
+            SegmentFileName(firstSegment++, fileName);
+            LittleFS.remove(fileName);
+        }
+
+        lastTime = now();
+        for (uint8_t i = 0; i < DATALOG_CHANNELS; i++)
+            previousValues[i] = 0;
+
+        uint32_t header[2] = {DATALOG_MAGIC, lastTime};
+        memcpy(buffer, header, DATALOG_HEADER_SIZE);
+        bufferLength = DATALOG_HEADER_SIZE;
+        segmentBytes = DATALOG_HEADER_SIZE;
+    }
+
+    size_t EncodeRecord(uint8_t channel, int16_t value, uint32_t time, uint8_t *dest)
+    {
+        int32_t delta = (int32_t)value - previousValues[channel];
+        size_t n = 0;
+
+        dest[n++] = channel;
+        n += WriteVarint(dest + n, time - lastTime);
+        n += WriteVarint(dest + n, (uint32_t)((delta << 1) ^ (delta >> 31)));
+
+        return n;
+    }
+
+    void Append(uint8_t channel, int16_t value)
+    {
+        if (channel >= DATALOG_CHANNELS || currentSegment == 0)
+            return;
+
+        uint32_t time = now();
+        uint8_t record[DATALOG_MAX_RECORD_SIZE];
+
+        //  A clock set backwards cannot be delta encoded, so it starts a new segment
+        if (time < lastTime)
+            StartSegment();
+
+        size_t length = EncodeRecord(channel, value, time, record);
+
+        if (segmentBytes + length > DATALOG_SEGMENT_SIZE)
+        {
+            StartSegment();
+            length = EncodeRecord(channel, value, time, record);
+        }
+
+        if (bufferLength + length > DATALOG_BUFFER_SIZE)
+            Flush();
+
+        memcpy(buffer + bufferLength, record, length);
+        bufferLength += length;
+        segmentBytes += length;
+
+        lastTime = time;
+        previousValues[channel] = value;
+    }
+
+    void LogTemperature(uint8_t sensor, int16_t raw)
+    {
+        Append(sensor, raw);
+    }
+
+    void LogEvent(uint8_t channel, bool state)
+    {
+        Append(channel, state ? 1 : 0);
+    }
+
+    void LogValue(uint8_t channel, int16_t value)
+    {
+        Append(channel, value);
+    }
+
+    void OpenCursor(logCursor &cursor)
+    {
+        cursor.segment = firstSegment;
+        cursor.offset = 0;
+    }
+
+    //  Reads up to maxRecords from the cursor position onwards, moving the cursor.
+    //  Returns 0 once all segments have been read.
+    size_t ReadRecords(logCursor &cursor, logRecord *records, size_t maxRecords)
+    {
+        size_t count = 0;
+
+        while (count < maxRecords && cursor.segment != 0 && cursor.segment <= currentSegment)
+        {
+            char fileName[20];
+            SegmentFileName(cursor.segment, fileName);
+
+            File f = LittleFS.open(fileName, "r");
+            if (!f)
+            {
+                cursor.segment++;
+                cursor.offset = 0;
+                continue;
+            }
+
+            if (cursor.offset == 0)
+            {
+                uint32_t header[2];
+                if (f.read((uint8_t *)header, DATALOG_HEADER_SIZE) != DATALOG_HEADER_SIZE || header[0] != DATALOG_MAGIC)
+                {
+                    f.close();
+                    cursor.segment++;
+                    continue;
+                }
+
+                cursor.time = header[1];
+                for (uint8_t i = 0; i < DATALOG_CHANNELS; i++)
+                    cursor.previousValues[i] = 0;
+                cursor.offset = DATALOG_HEADER_SIZE;
+            }
+
+            f.seek(cursor.offset);
+
+            bool endOfSegment = false;
+            while (count < maxRecords)
+            {
+                int channel = f.read();
+                uint32_t timeDelta, zigzag;
+
+                //  A partially written record at the end of the file is ignored
+                if (channel < 0 || channel >= DATALOG_CHANNELS || !ReadVarint(f, timeDelta) || !ReadVarint(f, zigzag))
+                {
+                    endOfSegment = true;
+                    break;
+                }
+
+                int32_t delta = (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+
+                cursor.time += timeDelta;
+                cursor.previousValues[channel] += delta;
+                cursor.offset = f.position();
+
+                records[count].time = cursor.time;
+                records[count].channel = channel;
+                records[count].value = cursor.previousValues[channel];
+                count++;
+            }
+            f.close();
+
+            if (endOfSegment)
+            {
+                //  The segment being written may still grow, so the cursor stays on it
+                if (cursor.segment == currentSegment)
+                    break;
+
+                cursor.segment++;
+                cursor.offset = 0;
+            }
+        }
+
+        return count;
+    }
+
+    //  Formats a record as a CSV line or a JSON object, temperatures in °C
+    size_t FormatRecord(const logRecord &record, bool json, char *dest, size_t size)
+    {
+        char value[TEMPERATURE_STRING_LENGTH];
+        const char *type;
+
+        if (record.channel == DATALOG_CHANNEL_PIR)
+        {
+            type = "pir";
+            itoa(record.value, value, DEC);
+        }
+        else if (record.channel == DATALOG_CHANNEL_HALL)
+        {
+            type = "hall";
+            itoa(record.value, value, DEC);
+        }
+        else
+        {
+            type = "temperature";
+            tempSensors::FormatTemperature(record.value, value);
+        }
+
+        if (json)
+            return snprintf(dest, size, "{\"Time\":%u,\"Type\":\"%s\",\"Channel\":%u,\"Value\":%s}", record.time, type, record.channel, value);
+
+        return snprintf(dest, size, "%u,%s,%u,%s\r\n", record.time, type, record.channel, value);
+    }
+
+    void StartBackfill(uint32_t since)
+    {
+        Flush();
+        OpenCursor(backfillCursor);
+        backfillSince = since;
+        backfillActive = true;
+    }
+
+    //  Publishes one batch of logged records per call so the loop is never held up for long
+    void Backfill()
+    {
+        if (!mqtt::PSclient.connected())
+            return;
+
+        logRecord records[DATALOG_BACKFILL_BATCH];
+        size_t count = ReadRecords(backfillCursor, records, DATALOG_BACKFILL_BATCH);
+
+        if (count == 0)
+        {
+            mqtt::PublishData("datalog/backfill", "[]", false);
+            backfillActive = false;
+            return;
+        }
+
+        String payload = "[";
+        char line[96];
+        bool first = true;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            if (records[i].time < backfillSince)
+                continue;
+
+            if (!first)
+                payload += ",";
+            FormatRecord(records[i], true, line, sizeof(line));
+            payload += line;
+            first = false;
+        }
+        payload += "]";
+
+        if (!first)
+            mqtt::PublishData("datalog/backfill", payload.c_str(), false);
+    }
+
+    //  Called before going to sleep, after Flush()
+    void GetState(logState &state)
+    {
+        state.segment = currentSegment;
+        state.segmentBytes = segmentBytes;
+        state.time = lastTime;
+        memcpy(state.previousValues, previousValues, sizeof(previousValues));
+    }
+
+    //  Called after a deep sleep wake, before setup()
+    void Resume(const logState &state)
+    {
+        resumeState = state;
+        resumePending = true;
+    }
+
+    //  The segment written before the sleep is continued if it is still the newest one,
+    //  exactly as long as it was left, and the clock has not gone backwards
+    bool ResumeSegment()
+    {
+        if (!resumePending || resumeState.segment == 0 || resumeState.segment != currentSegment || timeStatus() == timeNotSet || now() < resumeState.time)
+            return false;
+
+        char fileName[20];
+        SegmentFileName(currentSegment, fileName);
+
+        File f = LittleFS.open(fileName, "r");
+        if (!f)
+            return false;
+        size_t size = f.size();
+        f.close();
+
+        if (size != resumeState.segmentBytes)
+            return false;
+
+        segmentBytes = resumeState.segmentBytes;
+        lastTime = resumeState.time;
+        memcpy(previousValues, resumeState.previousValues, sizeof(previousValues));
+        return true;
+    }
+
+    void setup()
+    {
+        LittleFS.mkdir(DATALOG_DIRECTORY);
+
+        Dir dir = LittleFS.openDir(DATALOG_DIRECTORY);
+        while (dir.next())
+        {
+            uint32_t segment = atol(dir.fileName().c_str());
+            if (segment == 0)
+                continue;
+
+            if (firstSegment == 0 || segment < firstSegment)
+                firstSegment = segment;
+            if (segment > currentSegment)
+                currentSegment = segment;
+        }
+
+        //  Every other boot starts a fresh segment so the delta state never has to be recovered
+        if (!ResumeSegment())
+            StartSegment();
+        resumePending = false;
+
+#ifdef __debugSettings
+        Serial.printf_P(PSTR("Data log: segments %u..%u.\r\n"), firstSegment, currentSegment);
+#endif
+    }
+
+    void loop()
+    {
+        if (millis() - lastFlushMillis > DATALOG_FLUSH_INTERVAL * 1000)
+            Flush();
+
+        if (backfillActive)
+            Backfill();
+    }
+}
@@ -1,16 +1,236 @@
 #include <LittleFS.h>
+#include <Updater.h>
+#include <flash_hal.h>
+#include <coredecls.h>
+
+#include "filesystem.h"
 
 #define FORMAT_SPIFFS_IF_FAILED true
 
+#ifndef ATOMIC_FS_UPDATE
+#error "Filesystem images are staged and verified before they are installed, build with -DATOMIC_FS_UPDATE"
+#endif
+
+#define FS_RESTORE_MAGIC 0x46535253 //  "FSRS"
+#define FS_FILE_MISSING 0xFFFFFFFF
+
 namespace filesystem
 {
+    const char *preservedFiles[] = {"/config.json", "/filters.json", "/pulses.bin", "/wifi.bin"};
+    const size_t preservedCount = sizeof(preservedFiles) / sizeof(preservedFiles[0]);
+
+    //  The restore record sits in the free flash right after the sketch. The staged image
+    //  goes to the top of the same area, right below the filesystem, and eboot only
+    //  copies the image, so the record survives the installation.
+    //  After the header, for every preserved file: its size (FS_FILE_MISSING if it
+    //  did not exist), then its contents padded to 4 bytes.
+    struct restoreHeader
+    {
+        uint32_t magic;
+        uint32_t committed; //  erased (all ones) until the image is committed, then 0
+        uint32_t length;    //  bytes after the header
+        uint32_t checksum;
+        char version[32];
+    };
+
+    uint32_t RecordAddress()
+    {
+        return (ESP.getSketchSize() + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+    }
+
+    size_t Padded(size_t size)
+    {
+        return (size + 3) & ~3;
+    }
+
+    void InvalidateRecord()
+    {
+        ESP.flashEraseSector(RecordAddress() / FLASH_SECTOR_SIZE);
+    }
+
+    //  Writes the preserved files and the version into the restore record, returns its length
+    size_t WriteRecord(const char *version)
+    {
+        size_t length = 0;
+        File files[preservedCount];
+
+        for (size_t i = 0; i < preservedCount; i++)
+        {
+            files[i] = LittleFS.open(preservedFiles[i], "r");
+            if (files[i] && files[i].size() > FS_PRESERVED_MAX_SIZE)
+            {
+                Serial.printf_P(PSTR("Error: %s is too large to keep over a filesystem update.\r\n"), preservedFiles[i]);
+                return 0;
+            }
+            length += 4 + (files[i] ? Padded(files[i].size()) : 0);
+        }
+
+        uint8_t *record = (uint8_t *)malloc(sizeof(restoreHeader) + length);
+        if (!record)
+            return 0;
+        memset(record, 0, sizeof(restoreHeader) + length);
+
+        uint8_t *p = record + sizeof(restoreHeader);
+        for (size_t i = 0; i < preservedCount; i++)
+        {
+            uint32_t size = files[i] ? files[i].size() : FS_FILE_MISSING;
+            memcpy(p, &size, 4);
+            p += 4;
+
+            if (files[i])
+            {
+                files[i].read(p, size);
+                files[i].close();
+                p += Padded(size);
+            }
+        }
+
+        restoreHeader *header = (restoreHeader *)record;
+        header->magic = FS_RESTORE_MAGIC;
+        header->committed = 0xFFFFFFFF;
+        header->length = length;
+        strlcpy(header->version, version, sizeof(header->version));
+        header->checksum = crc32(record + offsetof(restoreHeader, version), sizeof(restoreHeader) - offsetof(restoreHeader, version) + length);
+
+        size_t total = sizeof(restoreHeader) + length;
+        uint32_t address = RecordAddress();
+        bool ok = true;
+
+        for (uint32_t offset = 0; ok && offset < total; offset += FLASH_SECTOR_SIZE)
+            ok = ESP.flashEraseSector((address + offset) / FLASH_SECTOR_SIZE);
+        if (ok)
+            ok = ESP.flashWrite(address, (uint32_t *)record, total);
+
+        free(record);
+        return ok ? total : 0;
+    }
+
+    //  First boot after an image was installed: put the device's own files back
+    void RestoreRecord()
+    {
+        restoreHeader header;
+        uint32_t address = RecordAddress();
+
+        if (!ESP.flashRead(address, (uint32_t *)&header, sizeof(header)) || header.magic != FS_RESTORE_MAGIC)
+            return;
+
+        //  An update that never got committed left the old filesystem in place
+        if (header.committed || header.length > preservedCount * (4 + FS_PRESERVED_MAX_SIZE))
+        {
+            InvalidateRecord();
+            return;
+        }
+
+        uint8_t *record = (uint8_t *)malloc(sizeof(header) + header.length);
+        if (!record)
+            return;
+
+        if (ESP.flashRead(address, (uint32_t *)record, sizeof(header) + header.length) &&
+            header.checksum == crc32(record + offsetof(restoreHeader, version), sizeof(header) - offsetof(restoreHeader, version) + header.length))
+        {
+            uint8_t *p = record + sizeof(header);
+            for (size_t i = 0; i < preservedCount; i++)
+            {
+                uint32_t size;
+                memcpy(&size, p, 4);
+                p += 4;
+                if (size == FS_FILE_MISSING)
+                    continue;
+
+                File f = LittleFS.open(preservedFiles[i], "w");
+                if (f)
+                {
+                    f.write(p, size);
+                    f.close();
+                }
+                else
+                    Serial.printf_P(PSTR("Error: Failed to restore %s\r\n"), preservedFiles[i]);
+                p += Padded(size);
+            }
+
+            File f = LittleFS.open(FS_VERSION_FILE, "w");
+            if (f)
+            {
+                f.print(header.version);
+                f.close();
+            }
+
+            Serial.printf_P(PSTR("Filesystem %s installed, settings restored.\r\n"), header.version);
+        }
+
+        free(record);
+        InvalidateRecord();
+    }
+
+    bool BeginImageUpdate(size_t size, const char *version)
+    {
+        size_t recordLength = WriteRecord(version);
+        if (!recordLength)
+        {
+            Serial.println(F("Error: Could not save the settings for a filesystem update."));
+            return false;
+        }
+
+        //  The image is staged between the record and the filesystem
+        uint32_t recordEnd = (RecordAddress() + recordLength + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+        size_t space = FS_PHYS_ADDR > recordEnd ? FS_PHYS_ADDR - recordEnd : 0;
+
+        if (space > FS_PHYS_SIZE)
+            space = FS_PHYS_SIZE;
+        if (!size)
+            size = space;
+
+        if (size > space || !Update.begin(size, U_FS))
+        {
+            InvalidateRecord();
+            return false;
+        }
+
+        return true;
+    }
+
+    //  The live filesystem is untouched until the next boot, when eboot copies the verified image
+    bool EndImageUpdate(bool evenIfRemaining)
+    {
+        if (Update.end(evenIfRemaining))
+        {
+            uint32_t committed = 0;
+            ESP.flashWrite(RecordAddress() + offsetof(restoreHeader, committed), &committed, sizeof(committed));
+            return true;
+        }
+
+        InvalidateRecord();
+        return false;
+    }
+
+    //  A fully written image cannot be reset without committing it, the caller restarts instead
+    void AbortImageUpdate()
+    {
+        if (Update.isRunning() && Update.progress() < Update.size())
+            Update.end();
+        InvalidateRecord();
+    }
+
+    String ImageVersion()
+    {
+        File f = LittleFS.open(FS_VERSION_FILE, "r");
+        if (!f)
+            return String();
+
+        String version = f.readString();
+        f.close();
+        return version;
+    }
 
     void setup()
     {
         if (!LittleFS.begin())
         {
-            Serial.println("Error: Failed to initialize the filesystem!");
+            Serial.println(F("Error: Failed to initialize the filesystem!"));
+            return;
         }
+
+        RestoreRecord();
     }
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,230 @@
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <ArduinoJson.h>
+
+#include "filters.h"
+#include "settings.h"
+#include "tempSensors.h"
+#include "arena.h"
+
+//  Per-sensor overrides of the default filter settings, keyed by sensor address
+#define FILTERS_FILE "/filters.json"
+
+namespace filters
+{
+    //  All state is fixed-point (1/16 °C, the EMA keeps 8 extra fraction bits)
+    struct filterState
+    {
+        int16_t window[FILTER_MAX_MEDIAN_WINDOW];
+        uint8_t windowHead;
+        uint8_t windowCount;
+        int32_t ema;
+        int16_t output;
+        int16_t lastPublished;
+        uint8_t silentReadings;
+        bool primed;
+    };
+
+    filterConfig configs[32];
+    filterState states[32];
+
+    void Reset(uint8_t sensor)
+    {
+        states[sensor].windowHead = 0;
+        states[sensor].windowCount = 0;
+        states[sensor].primed = false;
+        states[sensor].lastPublished = TEMPERATURE_INVALID;
+        states[sensor].silentReadings = 0;
+    }
+
+    void GetSnapshot(uint8_t sensor, filterSnapshot &snapshot)
+    {
+        const filterState &s = states[sensor];
+
+        snapshot.ema = s.ema;
+        snapshot.lastPublished = s.lastPublished;
+        snapshot.silentReadings = s.silentReadings;
+        snapshot.primed = s.primed;
+    }
+
+    //  The median window is not kept, it refills from the next readings
+    void RestoreSnapshot(uint8_t sensor, const filterSnapshot &snapshot)
+    {
+        filterState &s = states[sensor];
+
+        Reset(sensor);
+        s.ema = snapshot.ema;
+        s.output = (snapshot.ema + 128) >> 8;
+        s.lastPublished = snapshot.lastPublished;
+        s.silentReadings = snapshot.silentReadings;
+        s.primed = snapshot.primed;
+    }
+
+    int16_t Median(const filterState &s)
+    {
+        int16_t sorted[FILTER_MAX_MEDIAN_WINDOW];
+
+        //  Insertion sort, the window is at most 7 values
+        for (uint8_t i = 0; i < s.windowCount; i++)
+        {
+            int16_t v = s.window[i];
+            int8_t j = i - 1;
+            while (j >= 0 && sorted[j] > v)
+            {
+                sorted[j + 1] = sorted[j];
+                j--;
+            }
+            sorted[j + 1] = v;
+        }
+
+        return sorted[s.windowCount / 2];
+    }
+
+    //  Median-of-N spike rejection, then rate-of-change limiting, then EMA smoothing
+    int16_t Apply(uint8_t sensor, int16_t raw)
+    {
+        const filterConfig &c = configs[sensor];
+        filterState &s = states[sensor];
+
+        uint8_t windowSize = constrain(c.medianWindow, 1, FILTER_MAX_MEDIAN_WINDOW);
+
+        s.window[s.windowHead] = raw;
+        s.windowHead = (s.windowHead + 1) % windowSize;
+        if (s.windowCount < windowSize)
+            s.windowCount++;
+
+        int16_t value = Median(s);
+
+        if (!s.primed)
+        {
+            s.ema = (int32_t)value << 8;
+            s.output = value;
+            s.primed = true;
+            return value;
+        }
+
+        if (c.maxRate)
+        {
+            int32_t change = (int32_t)value - (s.ema >> 8);
+            if (change > c.maxRate)
+                value = (s.ema >> 8) + c.maxRate;
+            else if (change < -(int32_t)c.maxRate)
+                value = (s.ema >> 8) - c.maxRate;
+        }
+
+        uint16_t weight = constrain(c.emaWeight, 1, FILTER_EMA_OFF);
+        s.ema += (((int32_t)value << 8) - s.ema) * weight / FILTER_EMA_OFF;
+
+        s.output = (s.ema + 128) >> 8;
+        return s.output;
+    }
+
+    //  Suppresses publishes that are within the deadband of the last published value
+    bool ShouldPublish(uint8_t sensor, int16_t filtered)
+    {
+        filterState &s = states[sensor];
+
+        if (s.lastPublished != TEMPERATURE_INVALID && configs[sensor].deadband &&
+            abs(filtered - s.lastPublished) < configs[sensor].deadband &&
+            ++s.silentReadings < FILTER_MAX_SILENT_READINGS)
+            return false;
+
+        s.lastPublished = filtered;
+        s.silentReadings = 0;
+        return true;
+    }
+
+    void ConfigFromJson(filterConfig &c, JsonVariantConst params)
+    {
+        c.medianWindow = params["median"] | c.medianWindow;
+        c.emaWeight = params["ema"] | c.emaWeight;
+        c.maxRate = params["rate"] | c.maxRate;
+        c.deadband = params["deadband"] | c.deadband;
+
+        //  Even window sizes have no single middle value
+        if (c.medianWindow % 2 == 0)
+            c.medianWindow++;
+        c.medianWindow = constrain(c.medianWindow, 1, FILTER_MAX_MEDIAN_WINDOW);
+        c.emaWeight = constrain(c.emaWeight, 1, FILTER_EMA_OFF);
+    }
+
+    bool SetConfig(uint8_t sensor, JsonVariantConst params)
+    {
+        if (sensor >= tempSensors::oneWireDevicesCount)
+            return false;
+
+        ConfigFromJson(configs[sensor], params);
+        Reset(sensor);
+
+        return SaveConfig();
+    }
+
+    bool SaveConfig()
+    {
+        arena::jsonDocument doc(JSON_OBJECT_SIZE(32) + 32 * JSON_OBJECT_SIZE(4));
+
+        for (uint8_t i = 0; i < tempSensors::oneWireDevicesCount; i++)
+        {
+            const filterConfig &c = configs[i];
+
+            if (c.medianWindow == settings::filterMedianWindow && c.emaWeight == settings::filterEmaWeight &&
+                c.maxRate == settings::filterMaxRate && c.deadband == settings::filterDeadband)
+                continue;
+
+            JsonObject obj = doc.createNestedObject((const char *)tempSensors::thermometers[i].addressHEX);
+            obj["median"] = c.medianWindow;
+            obj["ema"] = c.emaWeight;
+            obj["rate"] = c.maxRate;
+            obj["deadband"] = c.deadband;
+        }
+
+        File f = LittleFS.open(FILTERS_FILE, "w");
+        if (!f)
+        {
+            Serial.println(F("Failed to open filters file for writing"));
+            return false;
+        }
+        serializeJson(doc, f);
+        f.close();
+
+        return true;
+    }
+
+    void LoadConfig()
+    {
+        File f = LittleFS.open(FILTERS_FILE, "r");
+        if (!f)
+            return;
+
+        arena::jsonDocument doc(JSON_OBJECT_SIZE(32) + 32 * JSON_OBJECT_SIZE(4) + 32 * THERMOMETER_ADDRESS_LENGTH);
+        DeserializationError error = deserializeJson(doc, f);
+        f.close();
+
+        if (error)
+        {
+            Serial.println(F("Failed to parse filters file."));
+            return;
+        }
+
+        for (uint8_t i = 0; i < tempSensors::oneWireDevicesCount; i++)
+        {
+            JsonVariantConst params = doc[tempSensors::thermometers[i].addressHEX];
+            if (!params.isNull())
+                ConfigFromJson(configs[i], params);
+        }
+    }
+
+    void setup()
+    {
+        for (uint8_t i = 0; i < 32; i++)
+        {
+            configs[i].medianWindow = settings::filterMedianWindow;
+            configs[i].emaWeight = settings::filterEmaWeight;
+            configs[i].maxRate = settings::filterMaxRate;
+            configs[i].deadband = settings::filterDeadband;
+            Reset(i);
+        }
+
+        LoadConfig();
+    }
+}
@@ -0,0 +1,212 @@
+#include <Arduino.h>
+#include <TimeLib.h>
+#include <umm_malloc/umm_malloc.h>
+
+#include "heap.h"
+#include "settings.h"
+#include "scheduler.h"
+#include "timeService.h"
+#include "occupancy.h"
+#include "ota.h"
+#include "mqtt.h"
+#include "datalog.h"
+#include "logger.h"
+
+namespace heap
+{
+    HEAP_STATES state = HEAP_OK;
+
+    uint32_t freeHeap = 0;
+    uint32_t maxFreeBlock = 0;
+    uint8_t fragmentation = 0;
+
+    //  Worst values since boot
+    uint32_t minFreeHeap = UINT32_MAX;
+    uint32_t minMaxFreeBlock = UINT32_MAX;
+    uint8_t maxFragmentation = 0;
+
+    //  Smallest largest block per hour, the oldest first once the ring is full
+    uint16_t trend[HEAP_TREND_HOURS];
+    uint8_t trendCount = 0;
+    uint8_t trendNext = 0;
+    uint32_t hourMinMaxFreeBlock = UINT32_MAX;
+    uint32_t hourStartMillis = 0;
+
+    uint32_t stateMillis = 0;
+    uint32_t lowCount = 0;
+    uint32_t rejectedRequests = 0;
+    bool restartPlanned = false;
+
+    static const char *stateNames[] = {"OK", "Low", "Critical"};
+
+    bool RejectWebRequests()
+    {
+        if (state != HEAP_OK && settings::heapAction >= HEAP_ACTION_REJECT_WEB)
+        {
+            rejectedRequests++;
+            return true;
+        }
+        return false;
+    }
+
+    bool ShrinkBuffers()
+    {
+        return state != HEAP_OK && settings::heapAction >= HEAP_ACTION_SHRINK;
+    }
+
+    void TaskStarted()
+    {
+        umm_free_heap_size_min_reset();
+    }
+
+    uint32_t TaskLowWater()
+    {
+        uint32_t lowWater = umm_free_heap_size_min();
+        if (lowWater < minFreeHeap)
+            minFreeHeap = lowWater;
+        return lowWater;
+    }
+
+    void ToJson(JsonObject obj)
+    {
+        obj["State"] = stateNames[state];
+        obj["Free"] = freeHeap;
+        obj["MaxFreeBlock"] = maxFreeBlock;
+        obj["FragmentationPercent"] = fragmentation;
+        obj["MinFree"] = minFreeHeap;
+        obj["MinMaxFreeBlock"] = minMaxFreeBlock;
+        obj["MaxFragmentationPercent"] = maxFragmentation;
+        obj["LowEpisodes"] = lowCount;
+        obj["RejectedRequests"] = rejectedRequests;
+
+        JsonArray hourly = obj.createNestedArray("MaxFreeBlockHourly");
+        for (uint8_t i = 0; i < trendCount; i++)
+            hourly.add(trend[(trendNext + HEAP_TREND_HOURS - trendCount + i) % HEAP_TREND_HOURS]);
+
+        //  The lowest free heap seen while each task ran
+        JsonObject tasks = obj.createNestedObject("TaskLowWater");
+        for (uint8_t i = 0; i < scheduler::taskCount; i++)
+            tasks[scheduler::tasks[i].name] = scheduler::tasks[i].minFreeHeap;
+    }
+
+    void SetState(HEAP_STATES newState)
+    {
+        if (newState == state)
+            return;
+
+        char data[48];
+        snprintf(data, sizeof(data), "free %u, block %u, %u%%", freeHeap, maxFreeBlock, fragmentation);
+
+        if (newState > state)
+        {
+            if (state == HEAP_OK)
+                lowCount++;
+            logger::LogEvent(logger::System, 20, newState == HEAP_CRITICAL ? "Memory critical" : "Memory low", data, newState == HEAP_CRITICAL ? logger::LEVEL_ERROR : logger::LEVEL_WARNING);
+        }
+        else if (newState == HEAP_OK)
+            logger::LogEvent(logger::System, 21, "Memory recovered", data);
+
+        //  A worsening restarts the clock, an improvement to low keeps it running
+        if (newState > state || newState == HEAP_OK)
+            stateMillis = millis();
+
+        bool wasShrunk = ShrinkBuffers();
+        state = newState;
+        if (ShrinkBuffers() != wasShrunk)
+            mqtt::ResizeBuffer();
+    }
+
+    bool QuietTime()
+    {
+        if (occupancy::state != occupancy::STATE_VACANT)
+            return false;
+
+        //  Without a clock only the room can tell
+        if (timeStatus() == timeNotSet)
+            return true;
+
+        uint8_t localHour = hour(timeService::Local());
+        return localHour >= HEAP_QUIET_HOUR_START && localHour < HEAP_QUIET_HOUR_END;
+    }
+
+    //  Restarting on our own terms beats an allocation failure in the middle of something
+    void CheckRestart()
+    {
+        if (settings::heapAction < HEAP_ACTION_RESTART || state == HEAP_OK || ota::state != ota::OTA_IDLE)
+            return;
+
+        uint32_t seconds = (millis() - stateMillis) / 1000;
+        bool due = state == HEAP_CRITICAL ? seconds >= HEAP_RESTART_AFTER_CRITICAL : seconds >= HEAP_RESTART_AFTER_LOW && QuietTime();
+
+        if (!due)
+        {
+            if (!restartPlanned && state == HEAP_LOW && seconds >= HEAP_RESTART_AFTER_LOW)
+            {
+                restartPlanned = true;
+                logger::LogEvent(logger::Reboot, 10, "Restart planned", "low memory, waiting for a quiet time", logger::LEVEL_WARNING);
+            }
+            return;
+        }
+
+        char data[48];
+        snprintf(data, sizeof(data), "free %u, block %u, %u%%", freeHeap, maxFreeBlock, fragmentation);
+        logger::LogEvent(logger::Reboot, 11, "Low memory restart", data, logger::LEVEL_ERROR);
+
+        datalog::Flush();
+        logger::Flush();
+        mqtt::Disconnect();
+        ESP.restart();
+    }
+
+    void Sample()
+    {
+        ESP.getHeapStats(&freeHeap, &maxFreeBlock, &fragmentation);
+
+        if (freeHeap < minFreeHeap)
+            minFreeHeap = freeHeap;
+        if (maxFreeBlock < minMaxFreeBlock)
+            minMaxFreeBlock = maxFreeBlock;
+        if (fragmentation > maxFragmentation)
+            maxFragmentation = fragmentation;
+        if (maxFreeBlock < hourMinMaxFreeBlock)
+            hourMinMaxFreeBlock = maxFreeBlock;
+
+        if (millis() - hourStartMillis >= 3600000UL)
+        {
+            trend[trendNext] = min(hourMinMaxFreeBlock, (uint32_t)UINT16_MAX);
+            trendNext = (trendNext + 1) % HEAP_TREND_HOURS;
+            if (trendCount < HEAP_TREND_HOURS)
+                trendCount++;
+            hourMinMaxFreeBlock = UINT32_MAX;
+            hourStartMillis = millis();
+        }
+    }
+
+    void setup()
+    {
+        hourStartMillis = millis();
+        Sample();
+    }
+
+    void loop()
+    {
+        Sample();
+
+        uint32_t lowMark = settings::heapLowBlock;
+
+        //  Each level is left only a good margin above where it was entered
+        if (maxFreeBlock < lowMark / 2)
+            SetState(HEAP_CRITICAL);
+        else if (maxFreeBlock < lowMark)
+            SetState(state == HEAP_CRITICAL && maxFreeBlock < lowMark / 2 + HEAP_HYSTERESIS ? HEAP_CRITICAL : HEAP_LOW);
+        else if (maxFreeBlock >= lowMark + HEAP_HYSTERESIS)
+            SetState(HEAP_OK);
+        else if (state == HEAP_CRITICAL)
+            SetState(HEAP_LOW);
+
+        if (state == HEAP_OK)
+            restartPlanned = false;
+
+        CheckRestart();
+    }
+}
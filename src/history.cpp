@@ -0,0 +1,294 @@
+#include <Arduino.h>
+#include <TimeLib.h>
+
+#include "history.h"
+#include "tempSensors.h"
+#include "settings.h"
+
+namespace history
+{
+    //  An open (not yet closed) downsampling bucket
+    struct bucket
+    {
+        int32_t sum;
+        uint16_t count;
+    };
+
+    struct ringBuffer
+    {
+        int16_t *values;
+        uint16_t size;
+        uint16_t head; //  next position to write
+        uint16_t count;
+        uint32_t period;          //  seconds per entry
+        uint32_t newestUptime;    //  uptime (s) when the newest entry was closed
+        uint32_t currentBucketId; //  uptime / period of the open bucket
+        bucket open;
+    };
+
+    struct aggregate
+    {
+        uint32_t count;
+        int64_t sum;
+        int64_t sumSquares;
+        int16_t min;
+        int16_t max;
+    };
+
+    struct sensorHistory
+    {
+        ringBuffer tiers[NUMBER_OF_TIERS];
+        aggregate lifetime;
+    };
+
+    static const char *tierNames[NUMBER_OF_TIERS] = {"raw", "minute", "quarter"};
+    static const uint16_t tierSizes[NUMBER_OF_TIERS] = {HISTORY_RAW_SIZE, HISTORY_MINUTE_SIZE, HISTORY_QUARTER_SIZE};
+    static const uint32_t tierPeriods[NUMBER_OF_TIERS] = {0, 60, 900};
+
+    sensorHistory *histories = nullptr;
+    int16_t *valueStore = nullptr;
+    uint8_t sensorCount = 0;
+
+    uint32_t Uptime()
+    {
+        return millis() / 1000;
+    }
+
+    void Push(ringBuffer &ring, int16_t value)
+    {
+        ring.values[ring.head] = value;
+        ring.head = (ring.head + 1) % ring.size;
+        if (ring.count < ring.size)
+            ring.count++;
+        ring.newestUptime = Uptime();
+    }
+
+    //  Index of the i-th oldest entry
+    uint16_t Oldest(const ringBuffer &ring, uint16_t i)
+    {
+        return (ring.head + ring.size - ring.count + i) % ring.size;
+    }
+
+    void ResetAggregate(aggregate &a)
+    {
+        a.count = 0;
+        a.sum = 0;
+        a.sumSquares = 0;
+        a.min = INT16_MAX;
+        a.max = INT16_MIN;
+    }
+
+    void Accumulate(aggregate &a, int16_t value)
+    {
+        a.count++;
+        a.sum += value;
+        a.sumSquares += (int32_t)value * value;
+        if (value < a.min)
+            a.min = value;
+        if (value > a.max)
+            a.max = value;
+    }
+
+    void AddReading(uint8_t sensor, int16_t raw)
+    {
+        if (sensor >= sensorCount)
+            return;
+
+        sensorHistory &h = histories[sensor];
+
+        Push(h.tiers[TIER_RAW], raw);
+        h.tiers[TIER_RAW].period = settings::temperatureRefreshInterval;
+
+        for (uint8_t t = TIER_MINUTE; t < NUMBER_OF_TIERS; t++)
+        {
+            h.tiers[t].open.sum += raw;
+            h.tiers[t].open.count++;
+        }
+
+        Accumulate(h.lifetime, raw);
+    }
+
+    //  Closes every downsampled bucket whose period has elapsed. Buckets without
+    //  readings are stored as TEMPERATURE_INVALID so positions stay evenly spaced in time.
+    void CloseBuckets()
+    {
+        uint32_t uptime = Uptime();
+
+        for (uint8_t s = 0; s < sensorCount; s++)
+        {
+            for (uint8_t t = TIER_MINUTE; t < NUMBER_OF_TIERS; t++)
+            {
+                ringBuffer &ring = histories[s].tiers[t];
+                uint32_t bucketId = uptime / ring.period;
+
+                if (bucketId == ring.currentBucketId)
+                    continue;
+
+                uint32_t elapsed = bucketId - ring.currentBucketId;
+                if (elapsed > ring.size)
+                    elapsed = ring.size;
+
+                Push(ring, ring.open.count ? (int16_t)(ring.open.sum / (int32_t)ring.open.count) : TEMPERATURE_INVALID);
+                while (--elapsed)
+                    Push(ring, TEMPERATURE_INVALID);
+
+                ring.open.sum = 0;
+                ring.open.count = 0;
+                ring.currentBucketId = bucketId;
+            }
+        }
+    }
+
+    int8_t FindSensor(const char *addressOrIndex)
+    {
+        if (addressOrIndex == nullptr || *addressOrIndex == 0)
+            return -1;
+
+        for (uint8_t i = 0; i < sensorCount; i++)
+            if (strcasecmp(addressOrIndex, tempSensors::thermometers[i].addressHEX) == 0)
+                return i;
+
+        char *end;
+        long index = strtol(addressOrIndex, &end, 10);
+        if (*end == 0 && index >= 0 && index < sensorCount)
+            return index;
+
+        return -1;
+    }
+
+    int8_t FindTier(const char *tierName)
+    {
+        if (tierName == nullptr || *tierName == 0)
+            return TIER_RAW;
+
+        for (uint8_t t = 0; t < NUMBER_OF_TIERS; t++)
+            if (strcasecmp(tierName, tierNames[t]) == 0)
+                return t;
+
+        return -1;
+    }
+
+    void PrintTemperature(Print &out, int16_t raw)
+    {
+        char buf[TEMPERATURE_STRING_LENGTH];
+
+        if (raw == TEMPERATURE_INVALID)
+        {
+            out.print("null");
+            return;
+        }
+        tempSensors::FormatTemperature(raw, buf);
+        out.print(buf);
+    }
+
+    void PrintAggregate(Print &out, const aggregate &a)
+    {
+        out.print("{\"Count\":");
+        out.print(a.count);
+
+        if (a.count)
+        {
+            int32_t average = a.sum / (int32_t)a.count;
+            int64_t variance = a.sumSquares / a.count - (int64_t)average * average;
+
+            out.print(",\"Min\":");
+            PrintTemperature(out, a.min);
+            out.print(",\"Max\":");
+            PrintTemperature(out, a.max);
+            out.print(",\"Avg\":");
+            PrintTemperature(out, average);
+            out.print(",\"StdDev\":");
+            PrintTemperature(out, variance > 0 ? (int16_t)sqrtf((float)variance) : 0);
+        }
+        out.print("}");
+    }
+
+    //  Writes the requested tier as JSON, oldest value first
+    bool PrintHistory(uint8_t sensor, uint8_t tier, Print &out)
+    {
+        if (sensor >= sensorCount || tier >= NUMBER_OF_TIERS)
+            return false;
+
+        const sensorHistory &h = histories[sensor];
+        const ringBuffer &ring = h.tiers[tier];
+
+        aggregate window;
+        ResetAggregate(window);
+
+        out.print("{\"Sensor\":\"");
+        out.print(tempSensors::thermometers[sensor].addressHEX);
+        out.print("\",\"Tier\":\"");
+        out.print(tierNames[tier]);
+        out.print("\",\"Period\":");
+        out.print(ring.period);
+        out.print(",\"Time\":");
+        out.print((uint32_t)now());
+        out.print(",\"Age\":");
+        out.print(ring.count ? Uptime() - ring.newestUptime : 0);
+        out.print(",\"Values\":[");
+
+        for (uint16_t i = 0; i < ring.count; i++)
+        {
+            int16_t value = ring.values[Oldest(ring, i)];
+            if (i)
+                out.print(",");
+            PrintTemperature(out, value);
+            if (value != TEMPERATURE_INVALID)
+                Accumulate(window, value);
+        }
+
+        out.print("],\"Window\":");
+        PrintAggregate(out, window);
+        out.print(",\"Lifetime\":");
+        PrintAggregate(out, h.lifetime);
+        out.print("}");
+
+        return true;
+    }
+
+    void setup()
+    {
+        sensorCount = tempSensors::oneWireDevicesCount;
+        if (sensorCount == 0)
+            return;
+
+        //  All history memory is allocated once, sized by the number of sensors found at boot
+        uint16_t valuesPerSensor = HISTORY_RAW_SIZE + HISTORY_MINUTE_SIZE + HISTORY_QUARTER_SIZE;
+
+        histories = new sensorHistory[sensorCount];
+        valueStore = new int16_t[sensorCount * valuesPerSensor];
+
+        for (uint8_t s = 0; s < sensorCount; s++)
+        {
+            int16_t *values = valueStore + s * valuesPerSensor;
+
+            for (uint8_t t = 0; t < NUMBER_OF_TIERS; t++)
+            {
+                ringBuffer &ring = histories[s].tiers[t];
+
+                ring.values = values;
+                ring.size = tierSizes[t];
+                ring.head = 0;
+                ring.count = 0;
+                ring.period = t == TIER_RAW ? settings::temperatureRefreshInterval : tierPeriods[t];
+                ring.newestUptime = 0;
+                ring.currentBucketId = t == TIER_RAW ? 0 : Uptime() / ring.period;
+                ring.open.sum = 0;
+                ring.open.count = 0;
+
+                values += ring.size;
+            }
+
+            ResetAggregate(histories[s].lifetime);
+        }
+
+#ifdef __debugSettings
+        Serial.printf_P(PSTR("History buffers allocated for %u sensor(s), %u bytes.\r\n"), sensorCount, sensorCount * (sizeof(sensorHistory) + valuesPerSensor * sizeof(int16_t)));
+#endif
+    }
+
+    void loop()
+    {
+        CloseBuckets();
+    }
+}
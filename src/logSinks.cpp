@@ -0,0 +1,220 @@
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <WiFiUdp.h>
+#include <TimeLib.h>
+#include <lwip/dns.h>
+
+#include "logSinks.h"
+#include "common.h"
+#include "settings.h"
+
+namespace logSinks
+{
+    WiFiUDP udp;
+
+    //  Looked up asynchronously by the logger task, nothing is sent until the address is
+    //  known. A blocking lookup for every event is not an option.
+    IPAddress serverIP;
+    bool serverResolved = false;
+    char resolvedName[sizeof(settings::logServer)] = ""; //  the name serverIP belongs to
+
+    bool lookupPending = false;
+    volatile bool lookupAnswered = false;
+    volatile bool lookupFound = false;
+    uint32_t lookupGeneration = 0;
+    uint32_t lookupMillis = 0;
+    uint32_t retrySeconds = 0;
+
+    //  Binary record header, followed by the title and the data, each prefixed by its length
+    struct __attribute__((packed)) binaryHeader
+    {
+        uint16_t magic;
+        uint8_t version;
+        uint8_t level;
+        uint32_t chipId;
+        uint32_t time;
+        uint32_t uptimeMs;
+        uint8_t category;
+        int16_t id;
+    };
+
+    bool ServerReady()
+    {
+        return serverResolved && !strcmp(resolvedName, settings::logServer);
+    }
+
+    void DnsFoundCallback(const char *name, const ip_addr_t *ipaddr, void *arg)
+    {
+        //  Answers to a lookup that timed out or belongs to an old name are ignored
+        if ((uint32_t)arg != lookupGeneration)
+            return;
+
+        lookupFound = ipaddr != nullptr;
+        if (lookupFound)
+            serverIP = IPAddress(ipaddr);
+        lookupAnswered = true;
+    }
+
+    void LookupFailed()
+    {
+        lookupPending = false;
+        lookupGeneration++;
+        retrySeconds = retrySeconds ? min(retrySeconds * 2, (uint32_t)LOG_SERVER_RETRY_MAX) : LOG_SERVER_RETRY_MIN;
+    }
+
+    void StartLookup()
+    {
+        ip_addr_t address;
+
+        lookupGeneration++;
+        lookupAnswered = false;
+        lookupMillis = millis();
+
+        if (serverIP.fromString(resolvedName))
+        {
+            serverResolved = true;
+            return;
+        }
+
+        err_t result = dns_gethostbyname(resolvedName, &address, DnsFoundCallback, (void *)lookupGeneration);
+
+        if (result == ERR_INPROGRESS)
+            lookupPending = true;
+        else if (result == ERR_OK)
+        {
+            serverIP = IPAddress(&address);
+            serverResolved = true;
+        }
+        else
+            LookupFailed();
+    }
+
+    //  RFC 5424 severities
+    uint8_t SyslogSeverity(uint8_t level)
+    {
+        static const uint8_t severities[] = {7, 6, 4, 3};
+        return severities[level];
+    }
+
+    //  SD-PARAM values escape '"', '\' and ']'
+    size_t AppendParamValue(char *dest, size_t size, const char *src)
+    {
+        size_t n = 0;
+
+        while (*src && n + 2 < size)
+        {
+            char c = *src++;
+            if (c == '"' || c == '\\' || c == ']')
+                dest[n++] = '\\';
+            dest[n++] = c;
+        }
+        dest[n] = 0;
+
+        return n;
+    }
+
+    bool WriteSyslog(const logger::logEvent &event)
+    {
+        if (!ServerReady())
+            return false;
+
+        char message[SYSLOG_MESSAGE_LENGTH];
+        char timestamp[21] = "-";
+
+        if (event.time)
+            sprintf(timestamp, "%04u-%02u-%02uT%02u:%02u:%02uZ", year(event.time), month(event.time), day(event.time),
+                    hour(event.time), minute(event.time), second(event.time));
+
+        //  <PRI>VERSION TIMESTAMP HOSTNAME APP-NAME PROCID MSGID [SD] MSG
+        size_t n = snprintf_P(message, sizeof(message), PSTR("<%u>1 %s %s %S - %s [event@32473 category=\"%u\" id=\"%d\" uptime=\"%u\" title=\""),
+                              SYSLOG_FACILITY * 8 + SyslogSeverity(event.level), timestamp, settings::localHost, common::FIRMWARE_ID,
+                              logger::levelNames[event.level], event.category, event.id, event.uptimeMs);
+
+        if (n >= sizeof(message) - 4)
+            return false;
+
+        n += AppendParamValue(message + n, sizeof(message) - n - 3, event.title);
+        n += strlcpy(message + n, "\"] ", sizeof(message) - n);
+        if (n < sizeof(message))
+            n += strlcpy(message + n, event.data, sizeof(message) - n);
+        n = min(n, sizeof(message) - 1);
+
+        if (!udp.beginPacket(serverIP, settings::logSyslogPort))
+            return false;
+        udp.write((const uint8_t *)message, n);
+        return udp.endPacket();
+    }
+
+    size_t AppendString(uint8_t *dest, const char *src)
+    {
+        size_t length = min(strlen(src), (size_t)BINARY_LOG_STRING_LENGTH);
+        *dest = length;
+        memcpy(dest + 1, src, length);
+        return length + 1;
+    }
+
+    bool WriteBinary(const logger::logEvent &event)
+    {
+        if (!ServerReady())
+            return false;
+
+        uint8_t packet[sizeof(binaryHeader) + 2 * (BINARY_LOG_STRING_LENGTH + 1)];
+        binaryHeader header = {BINARY_LOG_MAGIC, BINARY_LOG_VERSION, event.level, ESP.getChipId(), event.time, event.uptimeMs, event.category, (int16_t)event.id};
+
+        memcpy(packet, &header, sizeof(header));
+        size_t n = sizeof(header);
+        n += AppendString(packet + n, event.title);
+        n += AppendString(packet + n, event.data);
+
+        if (!udp.beginPacket(serverIP, settings::logBinaryPort))
+            return false;
+        udp.write(packet, n);
+        return udp.endPacket();
+    }
+
+    void setup()
+    {
+        logger::AddSink("syslog", WriteSyslog, &settings::logSyslogLevel);
+        logger::AddSink("binary", WriteBinary, &settings::logBinaryLevel);
+    }
+
+    //  Keeps the address of the log server, runs from the logger task
+    void loop()
+    {
+        //  A new server from the settings page starts over
+        if (strcmp(resolvedName, settings::logServer))
+        {
+            strlcpy(resolvedName, settings::logServer, sizeof(resolvedName));
+            serverResolved = false;
+            lookupPending = false;
+            lookupGeneration++;
+            retrySeconds = 0;
+        }
+
+        if (serverResolved || !resolvedName[0])
+            return;
+
+        if (lookupPending)
+        {
+            if (!lookupAnswered)
+            {
+                if (millis() - lookupMillis >= LOG_SERVER_LOOKUP_TIMEOUT)
+                    LookupFailed();
+                return;
+            }
+
+            lookupPending = false;
+            if (lookupFound)
+            {
+                serverResolved = true;
+                retrySeconds = 0;
+            }
+            else
+                LookupFailed();
+            return;
+        }
+
+        if (millis() - lookupMillis >= retrySeconds * 1000UL)
+            StartLookup();
+    }
+}
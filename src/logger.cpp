@@ -1,24 +1,226 @@
 #include <Arduino.h>
+#include <TimeLib.h>
 
+#include "logger.h"
 #include "settings.h"
 #include "mqtt.h"
+#include "logSinks.h"
+#include "arena.h"
 
 namespace logger
 {
-    void LogEvent(int Category, int ID, String Title, String Data)
+    //  Records are formatted when they are logged, so publishing only concatenates them
+    char ring[LOGGER_RING_SIZE][LOGGER_RECORD_LENGTH];
+    uint8_t ringHead = 0;
+    uint8_t ringCount = 0;
+
+    //  Token bucket per category
+    uint8_t tokens[EVENTCATEGORY_COUNT];
+    uint32_t lastRefillMillis = 0;
+    bool bucketsFilled = false;
+
+    logSink sinks[LOGGER_MAX_SINKS];
+    uint8_t sinkCount = 0;
+
+    uint32_t logged = 0;
+    uint32_t suppressed = 0;  //  over the rate limit of their category
+    uint32_t overwritten = 0; //  the ring was full, the oldest record was lost
+
+    const char *levelNames[] = {"debug", "info", "warning", "error"};
+
+    bool AddSink(const char *name, bool (*write)(const logEvent &event), const uint8_t *minLevel)
+    {
+        if (sinkCount >= LOGGER_MAX_SINKS)
+        {
+            Serial.printf_P(PSTR("Error: Too many log sinks, %s not added.\r\n"), name);
+            return false;
+        }
+
+        logSink &s = sinks[sinkCount++];
+        s.name = name;
+        s.write = write;
+        s.minLevel = minLevel;
+        s.written = 0;
+        s.failed = 0;
+        return true;
+    }
+
+    void RefillTokens()
+    {
+        if (!bucketsFilled)
+        {
+            memset(tokens, LOGGER_CATEGORY_BURST, sizeof(tokens));
+            lastRefillMillis = millis();
+            bucketsFilled = true;
+            return;
+        }
+
+        while (millis() - lastRefillMillis >= LOGGER_CATEGORY_REFILL * 1000UL)
+        {
+            lastRefillMillis += LOGGER_CATEGORY_REFILL * 1000UL;
+            for (uint8_t i = 0; i < EVENTCATEGORY_COUNT; i++)
+                if (tokens[i] < LOGGER_CATEGORY_BURST)
+                    tokens[i]++;
+        }
+    }
+
+    //  Copies src as a JSON string body, quotes and control characters escaped
+    size_t AppendEscaped(char *dest, size_t size, const char *src)
+    {
+        size_t n = 0;
+
+        while (*src && n + 2 < size)
+        {
+            char c = *src++;
+            if (c == '"' || c == '\\')
+                dest[n++] = '\\';
+            else if ((uint8_t)c < 0x20)
+                c = ' ';
+            dest[n++] = c;
+        }
+        dest[n] = 0;
+
+        return n;
+    }
+
+    //  The MQTT sink. It is rate limited per category because it shares the link and the
+    //  broker with the measurements, and queues the records until MQTT is connected.
+    bool WriteMqtt(const logEvent &event)
+    {
+        RefillTokens();
+
+        //  Errors are never rate limited
+        if (event.level != LEVEL_ERROR)
+        {
+            if (!tokens[event.category])
+            {
+                suppressed++;
+                return false;
+            }
+            tokens[event.category]--;
+        }
+
+        //  A full ring gives up its oldest record, the new one goes to the end as usual
+        if (ringCount == LOGGER_RING_SIZE)
+        {
+            ringHead = (ringHead + 1) % LOGGER_RING_SIZE;
+            ringCount--;
+            overwritten++;
+        }
+
+        char *record = ring[(ringHead + ringCount) % LOGGER_RING_SIZE];
+        size_t n = snprintf(record, LOGGER_RECORD_LENGTH, "{\"Time\":%u,\"Uptime\":%u,\"Level\":\"%s\",\"Category\":%u,\"ID\":%d,\"Title\":\"",
+                            event.time, event.uptimeMs / 1000, levelNames[event.level], event.category, event.id);
+
+        //  Leave room for the closing characters
+        n += AppendEscaped(record + n, LOGGER_RECORD_LENGTH - n - 13, event.title);
+        n += strlcpy(record + n, "\",\"Data\":\"", LOGGER_RECORD_LENGTH - n);
+        n += AppendEscaped(record + n, LOGGER_RECORD_LENGTH - n - 2, event.data);
+        strlcpy(record + n, "\"}", LOGGER_RECORD_LENGTH - n);
+
+        ringCount++;
+        return true;
+    }
+
+    void LogEvent(int Category, int ID, const char *Title, const char *Data, LOG_LEVELS Level)
     {
-        if (mqtt::PSclient.connected())
+        if (Category < 0 || Category >= EVENTCATEGORY_COUNT || Level >= LEVEL_NONE)
+            return;
+
+        logEvent event = {timeStatus() == timeNotSet ? 0 : (uint32_t)now(), millis(), (uint8_t)Level, (uint8_t)Category, ID, Title, Data};
+
+        for (uint8_t i = 0; i < sinkCount; i++)
+        {
+            logSink &s = sinks[i];
+
+            if (Level < *s.minLevel)
+                continue;
+
+            if (s.write(event))
+                s.written++;
+            else
+                s.failed++;
+        }
+
+        logged++;
+
+#ifdef __debugSettings
+        Serial.printf_P(PSTR("Log [%s] %d/%d %s: %s\r\n"), levelNames[Level], Category, ID, Title, Data);
+#endif
+    }
+
+    //  Publishes as many records as fit into one message. Returns false if nothing could be sent.
+    bool PublishBatch()
+    {
+        if (!ringCount || !mqtt::PSclient.connected())
+            return false;
+
+        //  Only needed while publishing, so it comes from the arena
+        arena::scope scope;
+        char *batch = (char *)arena::Allocate(LOGGER_BATCH_LENGTH);
+        if (!batch)
+            return false;
+
+        size_t n = snprintf(batch, LOGGER_BATCH_LENGTH, "{\"Node\":%u,\"Events\":[", ESP.getChipId());
+        uint8_t records = 0;
+
+        while (records < ringCount)
         {
-            String msg = "{";
+            const char *record = ring[(ringHead + records) % LOGGER_RING_SIZE];
+            size_t length = strlen(record);
 
-            msg += "\"Node\":" + (String)ESP.getChipId() + ",";
-            msg += "\"Category\":" + (String)Category + ",";
-            msg += "\"ID\":" + (String)ID + ",";
-            msg += "\"Title\":\"" + Title + "\",";
-            msg += "\"Data\":\"" + Data + "\"}";
+            if (n + length + 3 > LOGGER_BATCH_LENGTH)
+                break;
 
-            mqtt::PSclient.publish((mqtt::mqttCustomer + String("/") + mqtt::mqttProject + String("/") + settings::mqttTopic + "/log").c_str(), msg.c_str(), false);
-        }   
+            if (records)
+                batch[n++] = ',';
+            memcpy(batch + n, record, length);
+            n += length;
+            records++;
+        }
+        strcpy(batch + n, "]}");
+
+        arena::buffer topic;
+        if (!mqtt::PSclient.publish(mqtt::Topic(topic, topic.size, "log"), batch, false))
+            return false;
+
+        ringHead = (ringHead + records) % LOGGER_RING_SIZE;
+        ringCount -= records;
+        return true;
+    }
+
+    //  Sends everything that is queued, e.g. before a restart
+    void Flush()
+    {
+        while (ringCount && PublishBatch())
+            yield();
     }
 
-}
\ No newline at end of file
+    void ToJson(JsonObject obj)
+    {
+        obj["Logged"] = logged;
+        obj["Queued"] = ringCount;
+        obj["Suppressed"] = suppressed;
+        obj["Overwritten"] = overwritten;
+
+        JsonObject sinkList = obj.createNestedObject("Sinks");
+        for (uint8_t i = 0; i < sinkCount; i++)
+        {
+            JsonObject details = sinkList.createNestedObject(sinks[i].name);
+            details["Written"] = sinks[i].written;
+            details["Failed"] = sinks[i].failed;
+        }
+    }
+
+    void setup()
+    {
+        AddSink("mqtt", WriteMqtt, &settings::logMqttLevel);
+        logSinks::setup();
+    }
+
+    void loop()
+    {
+        logSinks::loop();
+        PublishBatch();
+    }
+}
@@ -9,39 +9,93 @@
 #include "leds.h"
 #include "tempSensors.h"
 #include "buttons.h"
+#include "history.h"
+#include "datalog.h"
+#include "pulseCounter.h"
+#include "occupancy.h"
+#include "ntp.h"
+#include "scheduler.h"
+#include "power.h"
+#include "boot.h"
+#include "logger.h"
+#include "heap.h"
 
 
 void setup()
 {
     Serial.begin(common::DEBUG_SPEED);
+#ifndef __fastBoot
     delay(1000); //  Wait for PlatformIO serial monitor
+#endif
 
     String FirmwareVersionString = String(FIRMWARE_VERSION) + " @ " + String(__TIME__) + " - " + String(__DATE__);
 
-    Serial.printf("\r\n\n\nBooting ESP node %u...\r\n", ESP.getChipId());
-    Serial.println("Hardware ID:      " + common::HARDWARE_ID);
-    Serial.println("Hardware version: " + common::HARDWARE_VERSION);
-    Serial.println("Software ID:      " + common::FIRMWARE_ID);
+    Serial.printf_P(PSTR("\r\n\n\nBooting ESP node %u...\r\n"), ESP.getChipId());
+    Serial.printf_P(PSTR("Hardware ID:      %S\r\n"), common::HARDWARE_ID);
+    Serial.printf_P(PSTR("Hardware version: %S\r\n"), common::HARDWARE_VERSION);
+    Serial.printf_P(PSTR("Software ID:      %S\r\n"), common::FIRMWARE_ID);
     Serial.println("Software version: " + FirmwareVersionString);
     Serial.println();
 
     filesystem::setup();
+    boot::Mark(boot::BOOT_FILESYSTEM);
     settings::setup();
+    boot::Mark(boot::BOOT_SETTINGS);
+    logger::setup();
+
+#ifdef __fastBoot
+    //  Association runs in the background while the rest is initialized
+    connection::setup();
+    connection::loop();
+#endif
+
     common::setup();
     leds::setup();
     network::setup();
+#ifndef __fastBoot
+    connection::setup();
+#endif
     ota::setup();
+    boot::Mark(boot::BOOT_NETWORK);
     mqtt::setup();
+    boot::Mark(boot::BOOT_MQTT);
     tempSensors::setup();
+    boot::Mark(boot::BOOT_SENSORS);
+    history::setup();
     buttons::setup();
+    pulseCounter::setup();
+    occupancy::setup();
+    power::setup();
+    datalog::setup(); //  after power, which restores the clock and the segment after a deep sleep wake
+    heap::setup();
+
+    //  Tasks: name, callback, period (ms), priority, time budget (µs), what it needs to run.
+    //  Local sensing and buffering never depend on connectivity.
+    scheduler::AddTask("buttons", buttons::loop, 0, scheduler::PRIORITY_CRITICAL, 1000, scheduler::GATE_NONE);
+    scheduler::AddTask("pulses", pulseCounter::loop, 100, scheduler::PRIORITY_CRITICAL, 2000, scheduler::GATE_NONE);
+    scheduler::AddTask("occupancy", occupancy::loop, 100, scheduler::PRIORITY_HIGH, 2000, scheduler::GATE_NONE);
+    scheduler::AddTask("tempSensors", tempSensors::loop, 1000, scheduler::PRIORITY_HIGH, 1000000, scheduler::GATE_NONE);
+    scheduler::AddTask("history", history::loop, 1000, scheduler::PRIORITY_NORMAL, 5000, scheduler::GATE_NONE);
+    scheduler::AddTask("datalog", datalog::loop, 1000, scheduler::PRIORITY_NORMAL, 50000, scheduler::GATE_NONE);
+    scheduler::AddTask("connection", connection::loop, 50, scheduler::PRIORITY_NORMAL, 100000, scheduler::GATE_NONE);
+    scheduler::AddTask("network", network::loop, 0, scheduler::PRIORITY_NORMAL, 50000, scheduler::GATE_NONE);
+    scheduler::AddTask("ota", ota::loop, 0, scheduler::PRIORITY_NORMAL, 5000, scheduler::GATE_WIFI);
+    scheduler::AddTask("mqtt", mqtt::loop, 0, scheduler::PRIORITY_NORMAL, 20000, scheduler::GATE_INTERNET);
+    scheduler::AddTask("ntp", ntp::loop, 10, scheduler::PRIORITY_LOW, 20000, scheduler::GATE_INTERNET);
+    scheduler::AddTask("logger", logger::loop, 1000, scheduler::PRIORITY_LOW, 20000, scheduler::GATE_INTERNET);
+    scheduler::AddTask("heap", heap::loop, HEAP_SAMPLE_INTERVAL, scheduler::PRIORITY_LOW, 5000, scheduler::GATE_NONE);
+    scheduler::AddTask("power", power::loop, 50, scheduler::PRIORITY_LOW, 1000000, scheduler::GATE_NONE);
 
 
 
     //  Finished setup()
-    Serial.println("Setup finished successfully.");
+    boot::Mark(boot::BOOT_SETUP_DONE);
+    logger::LogEvent(logger::System, 1, "Boot", ESP.getResetReason().c_str());
+    Serial.printf_P(PSTR("Setup finished successfully, %u bytes of heap free.\r\n"), ESP.getFreeHeap());
 }
 
 void loop()
 {
-    connection::loop();
+    scheduler::loop();
+    power::Idle();
 }
\ No newline at end of file
@@ -1,17 +1,34 @@
 #include <PubSubClient.h>
 #include <ArduinoJson.h>
 #include <ESP8266WiFi.h>
+#include <StreamString.h>
 
 #include "version.h"
 #include "settings.h"
 #include "network.h"
 #include "common.h"
 #include "logger.h"
-#include "TimeChangeRules.h"
+#include "tempSensors.h"
+#include "history.h"
+#include "datalog.h"
+#include "filters.h"
+#include "pulseCounter.h"
+#include "occupancy.h"
+#include "buttons.h"
+#include "connection.h"
+#include "scheduler.h"
+#include "power.h"
+#include "boot.h"
+#include "timeService.h"
+#include "ntp.h"
+#include "ota.h"
+#include "heap.h"
+#include "arena.h"
 
 namespace mqtt
 {
     bool needsHeartbeat = false;
+    bool heartbeatSent = false;
     os_timer_t heartbeatTimer;
 
     PubSubClient PSclient(network::client);
@@ -24,85 +41,168 @@ namespace mqtt
         needsHeartbeat = true;
     }
 
+    //  customer/project/topic/suffix
+    char *Topic(char *dest, size_t size, const char *suffix)
+    {
+        snprintf(dest, size, "%s/%s/%s/%s", mqttCustomer, mqttProject, settings::mqttTopic, suffix);
+        return dest;
+    }
+
     void ConnectToMQTTBroker()
     {
         if (!PSclient.connected())
         {
 #ifdef __debugSettings
-            Serial.printf("Connecting to MQTT broker %s... ", settings::mqttServer);
+            Serial.printf_P(PSTR("Connecting to MQTT broker %s... "), settings::mqttServer);
 #endif
-            if (PSclient.connect(settings::localHost, (mqttCustomer + String("/") + mqttProject + String("/") + settings::mqttTopic + "/STATE").c_str(), 0, true, "offline"))
+            arena::buffer stateTopic;
+            Topic(stateTopic, stateTopic.size, "STATE");
+
+            if (PSclient.connect(settings::localHost, stateTopic, 0, true, "offline"))
             {
 #ifdef __debugSettings
-                Serial.println(" success.");
+                Serial.println(F(" success."));
 #endif
-                PSclient.subscribe((mqttCustomer + String("/") + mqttProject + String("/") + settings::mqttTopic + "/cmnd").c_str(), 0);
-                PSclient.publish((mqttCustomer + String("/") + mqttProject + String("/") + settings::mqttTopic + "/STATE").c_str(), "online", true);
+                arena::buffer commandTopic;
+                PSclient.subscribe(Topic(commandTopic, commandTopic.size, "cmnd"), 0);
+                PSclient.publish(stateTopic, "online", true);
 
-                PSclient.setBufferSize(1024 * 5);
+                ResizeBuffer();
             }
             else
             {
 #ifdef __debugSettings
-                Serial.println(" failure!");
+                Serial.println(F(" failure!"));
 #endif
+                connection::ReportFailure();
             }
         }
     }
 
+    //  The buffer holds the largest message in or out, a smaller one still fits the heartbeat
+    void ResizeBuffer()
+    {
+        PSclient.setBufferSize(heap::ShrinkBuffers() ? MQTT_SHRUNK_BUFFER_SIZE : MQTT_BUFFER_SIZE);
+    }
+
+    //  A clean disconnect, so the broker does not publish the "offline" will
+    void Disconnect()
+    {
+        if (PSclient.connected())
+            PSclient.disconnect();
+    }
+
     void PublishData(const char *topic, const char *payload, bool retained)
     {
+        //  Sensing keeps running offline, it must not block on a broker that cannot be reached
+        if (!connection::isInternetConnected)
+            return;
+
         ConnectToMQTTBroker();
 
         if (PSclient.connected())
         {
-            PSclient.publish((mqttCustomer + String("/") + mqttProject + String("/") + settings::mqttTopic + String("/") + topic).c_str(), payload, retained);
+            arena::buffer fullTopic;
+            if (PSclient.publish(Topic(fullTopic, fullTopic.size, topic), payload, retained))
+                boot::Mark(boot::BOOT_FIRST_PUBLISH);
         }
     }
 
-    void SendHeartbeat()
+    //  Collects a streamed message in a formatting buffer, so the socket gets a few larger
+    //  writes instead of one per character
+    class publishStream : public Print
     {
+    public:
+        size_t write(uint8_t c) override
+        {
+            return write(&c, 1);
+        }
 
-        // todo
-        StaticJsonDocument<768> doc;
-
-        JsonObject sysDetails = doc.createNestedObject("System");
-        sysDetails["ChipID"] = (String)ESP.getChipId();
-
-        TimeChangeRule *tcr;
-        time_t localTime = timechangerules::timezones[settings::timeZone]->toLocal(now(), &tcr);
-        char myDate[20];
-        common::DateTimeToString(myDate, localTime);
-        sysDetails["Time"] = myDate;
-        sysDetails["Node"] = settings::localHost;
-        sysDetails["Freeheap"] = ESP.getFreeHeap();
-
-        sysDetails["HardwareID"] = common::HARDWARE_ID;
-        sysDetails["HardwareVersion"] = common::HARDWARE_VERSION;
-        sysDetails["FirmwareID"] = common::FIRMWARE_ID;
-        sysDetails["FirmwareVersion"] = FIRMWARE_VERSION;
-        sysDetails["UpTime"] = common::TimeIntervalToString(millis() / 1000);
-        sysDetails["CPU0_ResetReason"] = ESP.getResetReason();
-
-        sysDetails["FriendlyName"] = settings::nodeFriendlyName;
-        sysDetails["TIMEZONE"] = settings::timeZone;
-
-        JsonObject mqttDetails = doc.createNestedObject("MQTT");
+        size_t write(const uint8_t *data, size_t size) override
+        {
+            char *dest = buffer;
+            if (!dest)
+                return PSclient.write(data, size);
 
-        mqttDetails["MQTT_SERVER"] = settings::mqttServer;
-        mqttDetails["MQTT_PORT"] = settings::mqttPort;
-        mqttDetails["MQTT_TOPIC"] = settings::mqttTopic;
+            for (size_t i = 0; i < size; i++)
+            {
+                if (length == buffer.size && !Flush())
+                    return i;
+                dest[length++] = data[i];
+            }
+            return size;
+        }
 
-        JsonObject wifiDetails = doc.createNestedObject("WiFi");
-        wifiDetails["APP_NAME"] = settings::localHost;
-        wifiDetails["SSID"] = settings::wifiSSID;
-        wifiDetails["Channel"] = WiFi.channel();
-        wifiDetails["IP_Address"] = WiFi.localIP().toString();
-        wifiDetails["MAC_Address"] = WiFi.macAddress();
+        //  Returns false once anything could not be written
+        bool Flush()
+        {
+            if (length && !failed)
+                failed = PSclient.write((const uint8_t *)(char *)buffer, length) != length;
+            length = 0;
+            return !failed;
+        }
 
-        String myJsonString;
+    private:
+        arena::buffer buffer;
+        size_t length = 0;
+        bool failed = false;
+    };
 
-        serializeJson(doc, myJsonString);
+    void SendHeartbeat()
+    {
+        //  The keys live in flash and are copied into the document, which is sized for them
+        arena::jsonDocument doc(3648);
+
+        JsonObject sysDetails = doc.createNestedObject(F("System"));
+        sysDetails[F("ChipID")] = (String)ESP.getChipId();
+
+        char myDate[ISO8601_STRING_LENGTH];
+        sysDetails[F("Time")] = timeService::FormatIso8601(myDate);
+        sysDetails[F("Node")] = settings::localHost;
+        sysDetails[F("Freeheap")] = ESP.getFreeHeap();
+        heap::ToJson(doc.createNestedObject(F("Heap")));
+        arena::ToJson(doc.createNestedObject(F("Arena")));
+
+        sysDetails[F("HardwareID")] = FPSTR(common::HARDWARE_ID);
+        sysDetails[F("HardwareVersion")] = FPSTR(common::HARDWARE_VERSION);
+        sysDetails[F("FirmwareID")] = FPSTR(common::FIRMWARE_ID);
+        sysDetails[F("FirmwareVersion")] = FIRMWARE_VERSION;
+        sysDetails[F("UpTime")] = common::TimeIntervalToString(millis() / 1000);
+        sysDetails[F("CPU0_ResetReason")] = ESP.getResetReason();
+
+        sysDetails[F("FriendlyName")] = settings::nodeFriendlyName;
+        sysDetails[F("TIMEZONE")] = settings::timeZone;
+
+        JsonObject mqttDetails = doc.createNestedObject(F("MQTT"));
+
+        mqttDetails[F("MQTT_SERVER")] = settings::mqttServer;
+        mqttDetails[F("MQTT_PORT")] = settings::mqttPort;
+        mqttDetails[F("MQTT_TOPIC")] = settings::mqttTopic;
+
+        JsonObject wifiDetails = doc.createNestedObject(F("WiFi"));
+        wifiDetails[F("APP_NAME")] = settings::localHost;
+        wifiDetails[F("SSID")] = settings::wifiSSID;
+        wifiDetails[F("Channel")] = WiFi.channel();
+        wifiDetails[F("IP_Address")] = WiFi.localIP().toString();
+        wifiDetails[F("MAC_Address")] = WiFi.macAddress();
+
+        connection::ToJson(doc.createNestedObject(F("Connectivity")));
+        ntp::ToJson(doc.createNestedObject(F("NTP")));
+
+        tempSensors::TotalStatisticsToJson(doc.createNestedObject(F("Thermometers")));
+        pulseCounter::ToJson(doc.createNestedObject(F("Hall")));
+        occupancy::ToJson(doc.createNestedObject(F("Occupancy")));
+        buttons::ToJson(doc.createNestedObject(F("Inputs")));
+        power::ToJson(doc.createNestedObject(F("Power")));
+        logger::ToJson(doc.createNestedObject(F("Log")));
+
+        //  Boot timings go out once, with the first heartbeat after the boot
+        if (!boot::reported)
+            boot::ToJson(doc.createNestedObject(F("Boot")));
+
+#ifdef __loopProfiling
+        scheduler::ProfileToJson(doc.createNestedObject(F("Profile")), false);
+#endif
 
 #ifdef __debugSettings
         serializeJsonPretty(doc, Serial);
@@ -113,11 +213,37 @@ namespace mqtt
 
         if (PSclient.connected())
         {
-            PSclient.publish((mqttCustomer + String("/") + mqttProject + String("/") + settings::mqttTopic + "/HEARTBEAT").c_str(), myJsonString.c_str(), false);
+            //  Streamed straight to the socket, neither a serialized copy nor the MQTT buffer is needed
+            arena::buffer topic;
+            size_t length = measureJson(doc);
+            bool sent = false;
+
+            if (PSclient.beginPublish(Topic(topic, topic.size, "HEARTBEAT"), length, false))
+            {
+                publishStream stream;
+                sent = serializeJson(doc, stream) == length && stream.Flush();
+                PSclient.endPublish(); //  always returns 1, the result is the byte count above
+            }
+
+            if (sent)
+            {
+                boot::Mark(boot::BOOT_FIRST_PUBLISH);
+                boot::reported = true;
+                heartbeatSent = true;
 #ifdef __debugSettings
-            Serial.println("Heartbeat sent.");
+                Serial.println(F("Heartbeat sent."));
 #endif
+            }
+            else
+            {
+                //  The broker got less than the announced length, the session cannot be trusted
+                //  anymore. Dropping the socket lets the will announce it and the next publish reconnects.
+                Serial.println(F("Error: Heartbeat could not be sent."));
+                network::client.stop();
+            }
             mqtt::needsHeartbeat = false;
+
+            tempSensors::PublishStatistics();
         }
     }
 
@@ -125,13 +251,13 @@ namespace mqtt
     {
         const size_t capacity = JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(14) + 300;
 
-        DynamicJsonDocument doc(capacity);
-        deserializeJson(doc, payload);
+        arena::jsonDocument doc(capacity);
+        deserializeJson(doc, payload, len);
 
 #ifdef __debugSettings
-        Serial.print("Message arrived in topic [");
+        Serial.print(F("Message arrived in topic ["));
         Serial.print(topic);
-        Serial.println("]: ");
+        Serial.println(F("]: "));
 
         serializeJsonPretty(doc, Serial);
         Serial.println();
@@ -146,10 +272,52 @@ namespace mqtt
         {
             // ChangeSettings_JSON(doc.getMember("params"));
         }
+        else if (!strcmp(command, "GetHistory"))
+        {
+            int8_t sensor = history::FindSensor(doc["params"]["sensor"]);
+            int8_t tier = history::FindTier(doc["params"]["tier"]);
+
+            if (sensor >= 0 && tier >= 0)
+            {
+                StreamString jsonString;
+                history::PrintHistory(sensor, tier, jsonString);
+
+                arena::buffer historyTopic;
+                snprintf(historyTopic, historyTopic.size, "thermometers/%s/history", tempSensors::thermometers[sensor].addressHEX);
+                PublishData(historyTopic, jsonString.c_str(), false);
+            }
+        }
+        else if (!strcmp(command, "SetFilter"))
+        {
+            int8_t sensor = history::FindSensor(doc["params"]["sensor"]);
+            if (sensor >= 0)
+                filters::SetConfig(sensor, doc["params"]);
+        }
+        else if (!strcmp(command, "ResetPulseCounter"))
+        {
+            pulseCounter::ResetTotal();
+        }
+        else if (!strcmp(command, "Backfill"))
+        {
+            datalog::StartBackfill(doc["params"]["since"] | 0);
+        }
+        else if (!strcmp(command, "UpdateFirmware"))
+        {
+            ota::CheckForUpdate(doc["params"]["url"] | settings::otaManifestUrl, doc["params"]["force"] | false);
+        }
+        else if (!strcmp(command, "UpdateFilesystem"))
+        {
+            //  The filesystem manifest sits next to the firmware one unless given
+            arena::buffer url;
+            ota::ResolveUrl(settings::otaManifestUrl, "filesystem.json", url, url.size);
+            ota::CheckForUpdate(doc["params"]["url"] | (const char *)url, doc["params"]["force"] | false);
+        }
         else if (!strcmp(command, "ResetAllSettingsToDefault"))
         {
-            settings::DefaultSettings();
+            //  DefaultSettings() restarts as soon as the defaults are saved, the log goes first
             logger::LogEvent(logger::EVENTCATEGORIES::Reboot, 1, "Reset", "");
+            logger::Flush();
+            settings::DefaultSettings();
             ESP.restart();
         }
     }
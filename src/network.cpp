@@ -4,13 +4,23 @@
 #include <TimeLib.h>
 #include <ESP8266mDNS.h>
 #include <ArduinoOTA.h>
+#include <ArduinoJson.h>
+#include <StreamString.h>
 
 #include "version.h"
 #include "settings.h"
 #include "common.h"
 #include "TimeChangeRules.h"
+#include "timeService.h"
 #include "mqtt.h"
 #include "tempSensors.h"
+#include "history.h"
+#include "datalog.h"
+#include "scheduler.h"
+#include "connection.h"
+#include "filesystem.h"
+#include "heap.h"
+#include "arena.h"
 
 #define ADMIN_USERNAME "admin"
 #define ESP_ACCESS_POINT_NAME_SIZE 63
@@ -28,7 +38,26 @@ namespace network
 
     os_timer_t accessPointTimer;
 
-    TimeChangeRule *tcr;
+    //  Fixed responses stay in flash, they are sent with the _P functions or wrapped in FPSTR()
+    static const char TEXT_HTML[] PROGMEM = "text/html";
+    static const char TEXT_PLAIN[] PROGMEM = "text/plain";
+    static const char REDIRECT_TO_LOGIN[] PROGMEM = "HTTP/1.1 301 OK\r\nLocation: /login.html\r\nCache-Control: no-cache\r\n\r\n";
+    static const char LOGGED_OUT[] PROGMEM = "HTTP/1.1 301 OK\r\nSet-Cookie: EspAuth=0\r\nLocation: /login.html\r\nCache-Control: no-cache\r\n\r\n";
+    static const char LOGGED_IN[] PROGMEM = "HTTP/1.1 301 OK\r\nSet-Cookie: EspAuth=1\r\nLocation: /status.html\r\nCache-Control: no-cache\r\n\r\n";
+    static const char SERVICE_UNAVAILABLE[] PROGMEM = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 60\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    static const char LOGIN_FAILED_ALERT[] PROGMEM = "<div class=\"alert alert-danger\"><strong>Error!</strong> Wrong user name and/or password specified.<a href=\"#\" class=\"close\" data-dismiss=\"alert\" aria-label=\"close\">&times;</a></div>";
+
+    void SendText_P(int code, PGM_P text)
+    {
+        webServer.send_P(code, TEXT_PLAIN, text);
+    }
+
+    //  Compares a form field with a string in flash, without copying the latter
+    bool ArgEquals_P(const __FlashStringHelper *name, PGM_P value)
+    {
+        return !strcmp_P(webServer.arg(name).c_str(), value);
+    }
+
 
     bool is_authenticated()
     {
@@ -53,24 +82,22 @@ namespace network
         {
             String cookie = webServer.header("Cookie");
         }
-        if (webServer.hasArg("DISCONNECT"))
+        if (webServer.hasArg(F("DISCONNECT")))
         {
-            String header = "HTTP/1.1 301 OK\r\nSet-Cookie: EspAuth=0\r\nLocation: /login.html\r\nCache-Control: no-cache\r\n\r\n";
-            webServer.sendContent(header);
+            webServer.sendContent_P(LOGGED_OUT);
             return;
         }
-        if (webServer.hasArg("username") && webServer.hasArg("password"))
+        if (webServer.hasArg(F("username")) && webServer.hasArg(F("password")))
         {
-            if (webServer.arg("username") == ADMIN_USERNAME && webServer.arg("password") == settings::adminPassword)
+            if (ArgEquals_P(F("username"), PSTR(ADMIN_USERNAME)) && webServer.arg(F("password")) == settings::adminPassword)
             {
-                String header = "HTTP/1.1 301 OK\r\nSet-Cookie: EspAuth=1\r\nLocation: /status.html\r\nCache-Control: no-cache\r\n\r\n";
-                webServer.sendContent(header);
+                webServer.sendContent_P(LOGGED_IN);
                 return;
             }
-            msg = "<div class=\"alert alert-danger\"><strong>Error!</strong> Wrong user name and/or password specified.<a href=\"#\" class=\"close\" data-dismiss=\"alert\" aria-label=\"close\">&times;</a></div>";
+            msg = FPSTR(LOGIN_FAILED_ALERT);
         }
 
-        time_t localTime = timechangerules::timezones[settings::timeZone]->toLocal(now(), &tcr);
+        time_t localTime = timeService::Local();
 
         File f = LittleFS.open("/login.html", "r");
 
@@ -82,10 +109,10 @@ namespace network
         }
         f.close();
 
-        htmlString.replace("%year%", (String)year(localTime));
-        htmlString.replace("%alert%", msg);
+        htmlString.replace(F("%year%"), (String)year(localTime));
+        htmlString.replace(F("%alert%"), msg);
 
-        webServer.send(200, "text/html", htmlString);
+        webServer.send(200, FPSTR(TEXT_HTML), htmlString);
     }
 
     void handleStatus()
@@ -93,12 +120,11 @@ namespace network
 
         if (!is_authenticated())
         {
-            String header = "HTTP/1.1 301 OK\r\nLocation: /login.html\r\nCache-Control: no-cache\r\n\r\n";
-            webServer.sendContent(header);
+            webServer.sendContent_P(REDIRECT_TO_LOGIN);
             return;
         }
 
-        time_t localTime = timechangerules::timezones[settings::timeZone]->toLocal(now(), &tcr);
+        time_t localTime = timeService::Local();
 
         File f = LittleFS.open("/status.html", "r");
 
@@ -111,54 +137,58 @@ namespace network
         f.close();
 
         //  System information
-        htmlString.replace("%year%", (String)year(localTime));
-        htmlString.replace("%espid%", (String)ESP.getChipId());
-        htmlString.replace("%hardwareid%", common::HARDWARE_ID);
-        htmlString.replace("%hardwareversion%", common::HARDWARE_VERSION);
-        htmlString.replace("%firmwareid%", common::FIRMWARE_ID);
-        htmlString.replace("%firmwareversion%", String(FIRMWARE_VERSION));
-        htmlString.replace("%chipid%", String((String)ESP.getChipId()));
-        htmlString.replace("%uptime%", common::TimeIntervalToString(millis() / 1000));
-
-        char myDate[20];
-        common::DateTimeToString(myDate, localTime);
-
-        htmlString.replace("%currenttime%", myDate);
-
-        htmlString.replace("%lastresetreason%", ESP.getResetReason());
-        htmlString.replace("%flashchipsize%", String(ESP.getFlashChipSize()));
-        htmlString.replace("%flashchipspeed%", String(ESP.getFlashChipSpeed()));
-        htmlString.replace("%freeheapsize%", String(ESP.getFreeHeap()));
-        htmlString.replace("%freesketchspace%", String(ESP.getFreeSketchSpace()));
-        htmlString.replace("%friendlyname%", settings::nodeFriendlyName);
-        htmlString.replace("%mqtt-topic%", settings::mqttTopic);
+        htmlString.replace(F("%year%"), (String)year(localTime));
+        htmlString.replace(F("%espid%"), (String)ESP.getChipId());
+        htmlString.replace(F("%hardwareid%"), FPSTR(common::HARDWARE_ID));
+        htmlString.replace(F("%hardwareversion%"), FPSTR(common::HARDWARE_VERSION));
+        htmlString.replace(F("%firmwareid%"), FPSTR(common::FIRMWARE_ID));
+        htmlString.replace(F("%firmwareversion%"), String(FIRMWARE_VERSION));
+        htmlString.replace(F("%chipid%"), String((String)ESP.getChipId()));
+        htmlString.replace(F("%uptime%"), common::TimeIntervalToString(millis() / 1000));
+
+        char myDate[LOCAL_TIME_STRING_LENGTH];
+        htmlString.replace(F("%currenttime%"), timeService::FormatLocal(myDate));
+
+        htmlString.replace(F("%lastresetreason%"), ESP.getResetReason());
+        htmlString.replace(F("%flashchipsize%"), String(ESP.getFlashChipSize()));
+        htmlString.replace(F("%flashchipspeed%"), String(ESP.getFlashChipSpeed()));
+        htmlString.replace(F("%freeheapsize%"), String(ESP.getFreeHeap()));
+        htmlString.replace(F("%maxfreeblock%"), String(ESP.getMaxFreeBlockSize()));
+        htmlString.replace(F("%heapfragmentation%"), String(ESP.getHeapFragmentation()));
+        htmlString.replace(F("%freesketchspace%"), String(ESP.getFreeSketchSpace()));
+        htmlString.replace(F("%friendlyname%"), settings::nodeFriendlyName);
+        htmlString.replace(F("%mqtt-topic%"), settings::mqttTopic);
+        htmlString.replace(F("%otamanifesturl%"), settings::otaManifestUrl);
 
         //  Network settings
         switch (WiFi.getMode())
         {
         case WIFI_AP:
-            htmlString.replace("%wifimode%", "Access Point");
-            htmlString.replace("%macaddress%", String(WiFi.softAPmacAddress()));
-            htmlString.replace("%networkaddress%", WiFi.softAPIP().toString());
-            htmlString.replace("%ssid%", String(WiFi.SSID()));
-            htmlString.replace("%subnetmask%", "n/a");
-            htmlString.replace("%gateway%", "n/a");
+        case WIFI_AP_STA:
+            htmlString.replace(F("%wifimode%"), F("Access Point"));
+            htmlString.replace(F("%macaddress%"), String(WiFi.softAPmacAddress()));
+            htmlString.replace(F("%networkaddress%"), WiFi.softAPIP().toString());
+            htmlString.replace(F("%ssid%"), String(WiFi.SSID()));
+            htmlString.replace(F("%subnetmask%"), F("n/a"));
+            htmlString.replace(F("%gateway%"), F("n/a"));
             break;
         case WIFI_STA:
-            htmlString.replace("%wifimode%", "Station");
-            htmlString.replace("%macaddress%", WiFi.macAddress());
-            htmlString.replace("%networkaddress%", WiFi.localIP().toString());
-            htmlString.replace("%ssid%", String(WiFi.SSID()));
-            htmlString.replace("%channel%", String(WiFi.channel()));
-            htmlString.replace("%subnetmask%", WiFi.subnetMask().toString());
-            htmlString.replace("%gateway%", WiFi.gatewayIP().toString());
+            htmlString.replace(F("%wifimode%"), F("Station"));
+            htmlString.replace(F("%macaddress%"), WiFi.macAddress());
+            htmlString.replace(F("%networkaddress%"), WiFi.localIP().toString());
+            htmlString.replace(F("%ssid%"), String(WiFi.SSID()));
+            htmlString.replace(F("%channel%"), String(WiFi.channel()));
+            htmlString.replace(F("%subnetmask%"), WiFi.subnetMask().toString());
+            htmlString.replace(F("%gateway%"), WiFi.gatewayIP().toString());
             break;
         default:
             //  This should not happen...
             break;
         }
 
-        webServer.send(200, "text/html", htmlString);
+        htmlString.replace(F("%internetstatus%"), connection::isInternetConnected ? "Connected" : "Not connected");
+
+        webServer.send(200, FPSTR(TEXT_HTML), htmlString);
     }
 
     void handleGeneralSettings()
@@ -166,61 +196,174 @@ namespace network
 
         if (!is_authenticated())
         {
-            String header = "HTTP/1.1 301 OK\r\nLocation: /login.html\r\nCache-Control: no-cache\r\n\r\n";
-            webServer.sendContent(header);
+            webServer.sendContent_P(REDIRECT_TO_LOGIN);
             return;
         }
 
         if (webServer.method() == HTTP_POST)
         { //  POST
 #ifdef __debugSettings
-            Serial.println("================= Submitted data =================");
+            Serial.println(F("================= Submitted data ================="));
             for (int i = 0; i < webServer.args(); i++)
-                Serial.printf("%s: %s\r\n", webServer.argName(i).c_str(), webServer.arg(i).c_str());
-            Serial.println("==================================================");
+                Serial.printf_P(PSTR("%s: %s\r\n"), webServer.argName(i).c_str(), webServer.arg(i).c_str());
+            Serial.println(F("=================================================="));
 #endif
             //  System settings
-            if (webServer.hasArg("friendlyname"))
-                strcpy(settings::nodeFriendlyName, webServer.arg("friendlyname").c_str());
+            if (webServer.hasArg(F("friendlyname")))
+                strcpy(settings::nodeFriendlyName, webServer.arg(F("friendlyname")).c_str());
 
-            if (webServer.hasArg("heartbeatinterval"))
+            if (webServer.hasArg(F("heartbeatinterval")))
             {
                 os_timer_disarm(&mqtt::heartbeatTimer);
-                settings::heartbeatInterval = atoi(webServer.arg("heartbeatinterval").c_str());
+                settings::heartbeatInterval = atoi(webServer.arg(F("heartbeatinterval")).c_str());
                 os_timer_arm(&mqtt::heartbeatTimer, settings::heartbeatInterval * 1000, true);
             }
 
-            if (webServer.hasArg("timezoneselector"))
+            if (webServer.hasArg(F("internetcheckinterval")))
+            {
+                settings::internetCheckInterval = max(10, atoi(webServer.arg(F("internetcheckinterval")).c_str()));
+            }
+
+            if (webServer.hasArg(F("powermode")))
+            {
+                settings::powerMode = atoi(webServer.arg(F("powermode")).c_str());
+            }
+
+            if (webServer.hasArg(F("heaplowblock")))
+            {
+                settings::heapLowBlock = constrain(atoi(webServer.arg(F("heaplowblock")).c_str()), 1024, 16384);
+            }
+
+            if (webServer.hasArg(F("heapaction")))
+            {
+                settings::heapAction = atoi(webServer.arg(F("heapaction")).c_str());
+            }
+
+            if (webServer.hasArg(F("timezoneselector")))
             {
-                settings::timeZone = atoi(webServer.arg("timezoneselector").c_str());
+                settings::timeZone = atoi(webServer.arg(F("timezoneselector")).c_str());
             }
 
             //  MQTT settings
-            if (webServer.hasArg("mqttbroker"))
+            if (webServer.hasArg(F("mqttbroker")))
             {
-                sprintf(settings::mqttServer, "%s", webServer.arg("mqttbroker").c_str());
+                sprintf(settings::mqttServer, "%s", webServer.arg(F("mqttbroker")).c_str());
             }
 
-            if (webServer.hasArg("mqttport"))
+            if (webServer.hasArg(F("mqttport")))
             {
-                settings::mqttPort = atoi(webServer.arg("mqttport").c_str());
+                settings::mqttPort = atoi(webServer.arg(F("mqttport")).c_str());
             }
 
-            if (webServer.hasArg("mqtttopic"))
+            if (webServer.hasArg(F("mqtttopic")))
             {
-                if (webServer.arg("mqtttopic") == "")
+                if (webServer.arg(F("mqtttopic")) == "")
                 {
                     sprintf(settings::mqttTopic, "%s-%s", DEFAULT_MQTT_TOPIC, common::GetDeviceMAC().substring(6).c_str());
                 }
                 else
                 {
-                    sprintf(settings::mqttTopic, "%s", webServer.arg("mqtttopic").c_str());
+                    sprintf(settings::mqttTopic, "%s", webServer.arg(F("mqtttopic")).c_str());
                 }
             }
 
-            if (webServer.hasArg("temperatureRefreshInterval"))
+            if (webServer.hasArg(F("otamanifesturl")))
+            {
+                strlcpy(settings::otaManifestUrl, webServer.arg(F("otamanifesturl")).c_str(), sizeof(settings::otaManifestUrl));
+            }
+
+            if (webServer.hasArg(F("temperatureRefreshInterval")))
+            {
+                settings::temperatureRefreshInterval = atoi(webServer.arg(F("temperatureRefreshInterval")).c_str());
+            }
+
+            //  Filter settings
+            if (webServer.hasArg(F("filtermedianwindow")))
+            {
+                settings::filterMedianWindow = atoi(webServer.arg(F("filtermedianwindow")).c_str());
+            }
+
+            if (webServer.hasArg(F("filteremaweight")))
+            {
+                settings::filterEmaWeight = constrain(atoi(webServer.arg(F("filteremaweight")).c_str()), 1, 256);
+            }
+
+            if (webServer.hasArg(F("filtermaxrate")))
+            {
+                settings::filterMaxRate = atoi(webServer.arg(F("filtermaxrate")).c_str());
+            }
+
+            if (webServer.hasArg(F("filterdeadband")))
+            {
+                settings::filterDeadband = atoi(webServer.arg(F("filterdeadband")).c_str());
+            }
+
+            //  Hall sensor settings
+            if (webServer.hasArg(F("halldebounce")))
+            {
+                settings::hallDebounce = atoi(webServer.arg(F("halldebounce")).c_str());
+            }
+
+            if (webServer.hasArg(F("hallpulsesperrevolution")))
+            {
+                settings::hallPulsesPerRevolution = max(1, atoi(webServer.arg(F("hallpulsesperrevolution")).c_str()));
+            }
+
+            if (webServer.hasArg(F("hallpublishinterval")))
+            {
+                settings::hallPublishInterval = max(1, atoi(webServer.arg(F("hallpublishinterval")).c_str()));
+            }
+
+            if (webServer.hasArg(F("hallchangethreshold")))
+            {
+                settings::hallChangeThreshold = atoi(webServer.arg(F("hallchangethreshold")).c_str());
+            }
+
+            //  Log settings
+            if (webServer.hasArg(F("logmqttlevel")))
+            {
+                settings::logMqttLevel = atoi(webServer.arg(F("logmqttlevel")).c_str());
+            }
+
+            if (webServer.hasArg(F("logsysloglevel")))
+            {
+                settings::logSyslogLevel = atoi(webServer.arg(F("logsysloglevel")).c_str());
+            }
+
+            if (webServer.hasArg(F("logbinarylevel")))
+            {
+                settings::logBinaryLevel = atoi(webServer.arg(F("logbinarylevel")).c_str());
+            }
+
+            if (webServer.hasArg(F("logserver")))
+            {
+                strlcpy(settings::logServer, webServer.arg(F("logserver")).c_str(), sizeof(settings::logServer));
+            }
+
+            if (webServer.hasArg(F("logsyslogport")))
+            {
+                settings::logSyslogPort = atoi(webServer.arg(F("logsyslogport")).c_str());
+            }
+
+            if (webServer.hasArg(F("logbinaryport")))
+            {
+                settings::logBinaryPort = atoi(webServer.arg(F("logbinaryport")).c_str());
+            }
+
+            //  PIR occupancy settings
+            if (webServer.hasArg(F("pirholdtime")))
+            {
+                settings::pirHoldTime = atoi(webServer.arg(F("pirholdtime")).c_str());
+            }
+
+            if (webServer.hasArg(F("pirminontime")))
             {
-                settings::temperatureRefreshInterval = atoi(webServer.arg("temperatureRefreshInterval").c_str());
+                settings::pirMinOnTime = atoi(webServer.arg(F("pirminontime")).c_str());
+            }
+
+            if (webServer.hasArg(F("pirrollupinterval")))
+            {
+                settings::pirRollupInterval = max(1, atoi(webServer.arg(F("pirrollupinterval")).c_str()));
             }
 
             settings::SaveSettings();
@@ -229,7 +372,7 @@ namespace network
 
         File f = LittleFS.open("/generalsettings.html", "r");
 
-        time_t localTime = timechangerules::timezones[settings::timeZone]->toLocal(now(), &tcr);
+        time_t localTime = timeService::Local();
 
         String htmlString, timezoneslist = "";
 
@@ -238,19 +381,19 @@ namespace network
         for (signed char i = 0; i < (signed char)(sizeof(timechangerules::tzDescriptions) / sizeof(timechangerules::tzDescriptions[0])); i++)
         {
             itoa(i, ss, DEC);
-            timezoneslist += "<option ";
+            timezoneslist += F("<option ");
             if (settings::timeZone == i)
             {
-                timezoneslist += "selected ";
+                timezoneslist += F("selected ");
             }
-            timezoneslist += "value=\"";
+            timezoneslist += F("value=\"");
             timezoneslist += ss;
-            timezoneslist += "\">";
+            timezoneslist += F("\">");
 
             timezoneslist += timechangerules::tzDescriptions[i];
 
-            timezoneslist += "</option>";
-            timezoneslist += "\n";
+            timezoneslist += F("</option>");
+            timezoneslist += F("\n");
         }
 
         if (f.available())
@@ -262,15 +405,46 @@ namespace network
         String searchString = "value=\"" + (String)settings::temperatureRefreshInterval + "\"";
         htmlString.replace(searchString, searchString + " selected");
 
-        htmlString.replace("%year%", (String)year(localTime));
-        htmlString.replace("%mqtt-servername%", settings::mqttServer);
-        htmlString.replace("%mqtt-port%", String(settings::mqttPort));
-        htmlString.replace("%mqtt-topic%", settings::mqttTopic);
-        htmlString.replace("%timezoneslist%", timezoneslist);
-        htmlString.replace("%friendlyname%", settings::nodeFriendlyName);
-        htmlString.replace("%heartbeatinterval%", (String)settings::heartbeatInterval);
+        htmlString.replace(F("%year%"), (String)year(localTime));
+        htmlString.replace(F("%mqtt-servername%"), settings::mqttServer);
+        htmlString.replace(F("%mqtt-port%"), String(settings::mqttPort));
+        htmlString.replace(F("%mqtt-topic%"), settings::mqttTopic);
+        htmlString.replace(F("%timezoneslist%"), timezoneslist);
+        htmlString.replace(F("%friendlyname%"), settings::nodeFriendlyName);
+        htmlString.replace(F("%heartbeatinterval%"), (String)settings::heartbeatInterval);
+        htmlString.replace(F("%internetcheckinterval%"), (String)settings::internetCheckInterval);
+
+        searchString = "value=\"" + (String)settings::powerMode + "\" data-power";
+        htmlString.replace(searchString, searchString + " selected");
+
+        htmlString.replace(F("%heaplowblock%"), (String)settings::heapLowBlock);
+        searchString = "value=\"" + (String)settings::heapAction + "\" data-heap";
+        htmlString.replace(searchString, searchString + " selected");
+
+        searchString = "value=\"" + (String)settings::filterMedianWindow + "\" data-filter";
+        htmlString.replace(searchString, searchString + " selected");
+        htmlString.replace(F("%filteremaweight%"), (String)settings::filterEmaWeight);
+        htmlString.replace(F("%filtermaxrate%"), (String)settings::filterMaxRate);
+        htmlString.replace(F("%filterdeadband%"), (String)settings::filterDeadband);
+        htmlString.replace(F("%halldebounce%"), (String)settings::hallDebounce);
+        htmlString.replace(F("%hallpulsesperrevolution%"), (String)settings::hallPulsesPerRevolution);
+        htmlString.replace(F("%hallpublishinterval%"), (String)settings::hallPublishInterval);
+        htmlString.replace(F("%hallchangethreshold%"), (String)settings::hallChangeThreshold);
+        htmlString.replace(F("%pirholdtime%"), (String)settings::pirHoldTime);
+        htmlString.replace(F("%pirminontime%"), (String)settings::pirMinOnTime);
+        htmlString.replace(F("%pirrollupinterval%"), (String)settings::pirRollupInterval);
+
+        searchString = "value=\"" + (String)settings::logMqttLevel + "\" data-logmqtt";
+        htmlString.replace(searchString, searchString + " selected");
+        searchString = "value=\"" + (String)settings::logSyslogLevel + "\" data-logsyslog";
+        htmlString.replace(searchString, searchString + " selected");
+        searchString = "value=\"" + (String)settings::logBinaryLevel + "\" data-logbinary";
+        htmlString.replace(searchString, searchString + " selected");
+        htmlString.replace(F("%logserver%"), settings::logServer);
+        htmlString.replace(F("%logsyslogport%"), (String)settings::logSyslogPort);
+        htmlString.replace(F("%logbinaryport%"), (String)settings::logBinaryPort);
 
-        webServer.send(200, "text/html", htmlString);
+        webServer.send(200, FPSTR(TEXT_HTML), htmlString);
     }
 
     void handleNetworkSettings()
@@ -278,23 +452,34 @@ namespace network
 
         if (!is_authenticated())
         {
-            String header = "HTTP/1.1 301 OK\r\nLocation: /login.html\r\nCache-Control: no-cache\r\n\r\n";
-            webServer.sendContent(header);
+            webServer.sendContent_P(REDIRECT_TO_LOGIN);
             return;
         }
 
         if (webServer.method() == HTTP_POST)
         { //  POST
-            if (webServer.hasArg("ssid"))
+            if (webServer.hasArg(F("staticip")))
+            {
+                strlcpy(settings::staticIP, webServer.arg(F("staticip")).c_str(), sizeof(settings::staticIP));
+                strlcpy(settings::staticGateway, webServer.arg(F("staticgateway")).c_str(), sizeof(settings::staticGateway));
+                strlcpy(settings::staticSubnet, webServer.arg(F("staticsubnet")).c_str(), sizeof(settings::staticSubnet));
+                strlcpy(settings::staticDNS, webServer.arg(F("staticdns")).c_str(), sizeof(settings::staticDNS));
+            }
+
+            if (webServer.hasArg(F("ssid")))
+            {
+                strcpy(settings::wifiSSID, webServer.arg(F("ssid")).c_str());
+                strcpy(settings::wifiPassword, webServer.arg(F("password")).c_str());
+            }
+
+            if (webServer.hasArg(F("ssid")) || webServer.hasArg(F("staticip")))
             {
-                strcpy(settings::wifiSSID, webServer.arg("ssid").c_str());
-                strcpy(settings::wifiPassword, webServer.arg("password").c_str());
                 settings::SaveSettings();
                 ESP.restart();
             }
         }
 
-        time_t localTime = timechangerules::timezones[settings::timeZone]->toLocal(now(), &tcr);
+        time_t localTime = timeService::Local();
 
         File f = LittleFS.open("/networksettings.html", "r");
         String htmlString, wifiList;
@@ -302,9 +487,9 @@ namespace network
         byte numberOfNetworks = WiFi.scanNetworks();
         for (size_t i = 0; i < numberOfNetworks; i++)
         {
-            wifiList += "<div class=\"radio\"><label><input ";
+            wifiList += F("<div class=\"radio\"><label><input ");
             if (i == 0)
-                wifiList += "id=\"ssid\" ";
+                wifiList += F("id=\"ssid\" ");
 
             wifiList += "type=\"radio\" name=\"ssid\" value=\"" + WiFi.SSID(i) + "\">" + WiFi.SSID(i) + "</label></div>";
         }
@@ -315,46 +500,66 @@ namespace network
         }
         f.close();
 
-        htmlString.replace("%year%", (String)year(localTime));
-        htmlString.replace("%wifilist%", wifiList);
+        htmlString.replace(F("%year%"), (String)year(localTime));
+        htmlString.replace(F("%wifilist%"), wifiList);
+        htmlString.replace(F("%staticip%"), settings::staticIP);
+        htmlString.replace(F("%staticgateway%"), settings::staticGateway);
+        htmlString.replace(F("%staticsubnet%"), settings::staticSubnet);
+        htmlString.replace(F("%staticdns%"), settings::staticDNS);
 
-        webServer.send(200, "text/html", htmlString);
+        webServer.send(200, FPSTR(TEXT_HTML), htmlString);
     }
 
     void handleSensors()
     {
         if (!is_authenticated())
         {
-            String header = "HTTP/1.1 301 OK\r\nLocation: /login.html\r\nCache-Control: no-cache\r\n\r\n";
-            webServer.sendContent(header);
+            webServer.sendContent_P(REDIRECT_TO_LOGIN);
             return;
         }
 
-        time_t localTime = timechangerules::timezones[settings::timeZone]->toLocal(now(), &tcr);
+        time_t localTime = timeService::Local();
 
         String htmlString, ds18b20list, analogSensorlist, digitalinputlist;
 
         //  DS1820
         for (size_t i = 0; i < tempSensors::oneWireDevicesCount; i++)
         {
-            ds18b20list += "<div class=\"panel panel-default\"><div class=\"panel-heading\">DS-18B20</div>";
-            ds18b20list += "<div class=\"panel-body\"><table class=\"table table-hover\">";
-            ds18b20list += "<thead><tr><th>Name</th><th>Value</th></tr></thead><tbody><tr><td>Device ID</td><td>";
-            ds18b20list += tempSensors::OneWireDeviceAddress2HEX(tempSensors::thermometers[i].deviceAddress, ':');
-            ds18b20list += "</td></tr><tr><td>Power mode</td><td>";
+            ds18b20list += F("<div class=\"panel panel-default\"><div class=\"panel-heading\">DS-18B20</div>");
+            ds18b20list += F("<div class=\"panel-body\"><table class=\"table table-hover\">");
+            ds18b20list += F("<thead><tr><th>Name</th><th>Value</th></tr></thead><tbody><tr><td>Device ID</td><td>");
+            ds18b20list += tempSensors::thermometers[i].addressHEX;
+            ds18b20list += F("</td></tr><tr><td>Power mode</td><td>");
 
             if (tempSensors::thermometers[i].parasitePowered)
-                ds18b20list += "Parasite";
+                ds18b20list += F("Parasite");
             else
-                ds18b20list += "Powered";
+                ds18b20list += F("Powered");
 
-            ds18b20list += "</td></tr><tr><td>Resolution</td><td>";
+            ds18b20list += F("</td></tr><tr><td>Resolution</td><td>");
             ds18b20list += String(tempSensors::thermometers[i].resolution);
-            ds18b20list += " bits</td></tr><tr><td>Measurements are taken</td><td>Every ";
+            ds18b20list += F(" bits</td></tr><tr><td>Measurements are taken</td><td>Every ");
             ds18b20list += String(settings::temperatureRefreshInterval);
-            ds18b20list += " seconds</td></tr><tr><td>Last measured temperature</td><td>";
-            ds18b20list += String(tempSensors::thermometers[i].measuredTemperatureC);
-            ds18b20list += " °C</td></tr></tbody></table></div></div>";
+            ds18b20list += F(" seconds</td></tr><tr><td>Last measured temperature</td><td>");
+            char temperature[TEMPERATURE_STRING_LENGTH];
+            tempSensors::FormatTemperature(tempSensors::thermometers[i].filteredTemperature, temperature);
+            ds18b20list += temperature;
+            ds18b20list += F(" °C</td></tr><tr><td>Last raw reading</td><td>");
+            tempSensors::FormatTemperature(tempSensors::thermometers[i].rawTemperature, temperature);
+            ds18b20list += temperature;
+            ds18b20list += F(" °C</td></tr><tr><td>Successful reads</td><td>");
+            ds18b20list += String(tempSensors::thermometers[i].statistics.goodReads);
+            ds18b20list += F("</td></tr><tr><td>CRC errors</td><td>");
+            ds18b20list += String(tempSensors::thermometers[i].statistics.crcErrors);
+            ds18b20list += F("</td></tr><tr><td>Disconnects</td><td>");
+            ds18b20list += String(tempSensors::thermometers[i].statistics.disconnects);
+            ds18b20list += F("</td></tr><tr><td>Power-on resets (85 °C)</td><td>");
+            ds18b20list += String(tempSensors::thermometers[i].statistics.powerOnResets);
+            ds18b20list += F("</td></tr><tr><td>Retries</td><td>");
+            ds18b20list += String(tempSensors::thermometers[i].statistics.retries);
+            ds18b20list += F("</td></tr><tr><td>Failed reads</td><td>");
+            ds18b20list += String(tempSensors::thermometers[i].statistics.failedReads);
+            ds18b20list += F("</td></tr></tbody></table></div></div>");
         }
 
         File f = LittleFS.open("/sensors.html", "r");
@@ -365,34 +570,157 @@ namespace network
         }
         f.close();
 
-        htmlString.replace("%year%", (String)year(localTime));
-        htmlString.replace("%ds18b20list%", ds18b20list);
-        htmlString.replace("%analoginputlist%", analogSensorlist);
-        htmlString.replace("%digitalinputlist%", digitalinputlist);
+        htmlString.replace(F("%year%"), (String)year(localTime));
+        htmlString.replace(F("%ds18b20list%"), ds18b20list);
+        htmlString.replace(F("%analoginputlist%"), analogSensorlist);
+        htmlString.replace(F("%digitalinputlist%"), digitalinputlist);
+
+        webServer.send(200, FPSTR(TEXT_HTML), htmlString);
+    }
+
+    //  Serialized into the arena instead of a String
+    void SendJson(const JsonDocument &doc)
+    {
+        arena::scope scope;
+        size_t length = measureJson(doc);
+        char *json = (char *)arena::Allocate(length + 1);
+        if (!json)
+        {
+            SendText_P(503, PSTR("Out of memory"));
+            return;
+        }
+
+        serializeJson(doc, json, length + 1);
+        webServer.send(200, "application/json", json, length);
+    }
+
+    void handleSensorStatistics()
+    {
+        if (!is_authenticated())
+        {
+            SendText_P(401, PSTR("Unauthorized"));
+            return;
+        }
+
+        arena::jsonDocument doc(JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(7) + JSON_ARRAY_SIZE(32) + 32 * JSON_OBJECT_SIZE(7) + 32 * 24);
+
+        tempSensors::TotalStatisticsToJson(doc.createNestedObject("Total"));
+
+        JsonArray list = doc.createNestedArray("Thermometers");
+        for (size_t i = 0; i < tempSensors::oneWireDevicesCount; i++)
+        {
+            JsonObject obj = list.createNestedObject();
+            obj["Address"] = (const char *)tempSensors::thermometers[i].addressHEX;
+            tempSensors::StatisticsToJson(tempSensors::thermometers[i].statistics, obj);
+        }
+
+        SendJson(doc);
+    }
+
+    void handleHistory()
+    {
+        if (!is_authenticated())
+        {
+            SendText_P(401, PSTR("Unauthorized"));
+            return;
+        }
+
+        int8_t sensor = history::FindSensor(webServer.arg(F("sensor")).c_str());
+        int8_t tier = history::FindTier(webServer.arg(F("tier")).c_str());
+
+        if (sensor < 0 || tier < 0)
+        {
+            SendText_P(400, PSTR("Unknown sensor or tier"));
+            return;
+        }
+
+        StreamString jsonString;
+        history::PrintHistory(sensor, tier, jsonString);
+
+        webServer.send(200, "application/json", jsonString);
+    }
+
+    //  Streams the whole on-flash data log in chunks, so it never has to fit in RAM
+    void handleDataLog(bool json)
+    {
+        if (!is_authenticated())
+        {
+            SendText_P(401, PSTR("Unauthorized"));
+            return;
+        }
+
+        datalog::Flush();
+
+        webServer.setContentLength(CONTENT_LENGTH_UNKNOWN);
+        webServer.send(200, json ? "application/json" : "text/csv", json ? "[" : "time,type,channel,value\r\n");
+
+        //  Too large for the stack, the chunk comes from the arena for the length of the response
+        arena::scope scope;
+        const size_t chunkSize = 16 * 96;
+        char *chunk = (char *)arena::Allocate(chunkSize);
+
+        logCursor cursor;
+        logRecord records[16];
+        bool first = true;
+        size_t count;
+
+        datalog::OpenCursor(cursor);
+        while (chunk && (count = datalog::ReadRecords(cursor, records, 16)) > 0)
+        {
+            size_t length = 0;
+            for (size_t i = 0; i < count; i++)
+            {
+                if (json && !first)
+                    chunk[length++] = ',';
+                length += datalog::FormatRecord(records[i], json, chunk + length, chunkSize - length);
+                first = false;
+            }
+            webServer.sendContent(chunk, length);
+            yield();
+        }
+
+        if (json)
+            webServer.sendContent("]");
+        webServer.sendContent("");
+    }
+
+#ifdef __loopProfiling
+    void handleProfile()
+    {
+        if (!is_authenticated())
+        {
+            SendText_P(401, PSTR("Unauthorized"));
+            return;
+        }
+
+        arena::jsonDocument doc(JSON_OBJECT_SIZE(4) + JSON_OBJECT_SIZE(SCHEDULER_MAX_TASKS) +
+                                 SCHEDULER_MAX_TASKS * (JSON_OBJECT_SIZE(7) + JSON_ARRAY_SIZE(PROFILE_BUCKETS)));
 
-        webServer.send(200, "text/html", htmlString);
+        scheduler::ProfileToJson(doc.to<JsonObject>(), true);
+
+        SendJson(doc);
     }
+#endif
 
     void handleTools()
     {
 
         if (!is_authenticated())
         {
-            String header = "HTTP/1.1 301 OK\r\nLocation: /login.html\r\nCache-Control: no-cache\r\n\r\n";
-            webServer.sendContent(header);
+            webServer.sendContent_P(REDIRECT_TO_LOGIN);
             return;
         }
 
         if (webServer.method() == HTTP_POST)
         { //  POST
 
-            if (webServer.hasArg("reset"))
+            if (webServer.hasArg(F("reset")))
             {
                 settings::DefaultSettings();
                 ESP.restart();
             }
 
-            if (webServer.hasArg("restart"))
+            if (webServer.hasArg(F("restart")))
             {
                 ESP.restart();
             }
@@ -400,7 +728,7 @@ namespace network
 
         File f = LittleFS.open("/tools.html", "r");
 
-        time_t localTime = timechangerules::timezones[settings::timeZone]->toLocal(now(), &tcr);
+        time_t localTime = timeService::Local();
 
         String htmlString;
 
@@ -410,23 +738,22 @@ namespace network
         }
         f.close();
 
-        htmlString.replace("%year%", (String)year(localTime));
+        htmlString.replace(F("%year%"), (String)year(localTime));
 
-        webServer.send(200, "text/html", htmlString);
+        webServer.send(200, FPSTR(TEXT_HTML), htmlString);
     }
 
     void handleNotFound()
     {
         if (!is_authenticated())
         {
-            String header = "HTTP/1.1 301 OK\r\nLocation: /login.html\r\nCache-Control: no-cache\r\n\r\n";
-            webServer.sendContent(header);
+            webServer.sendContent_P(REDIRECT_TO_LOGIN);
             return;
         }
 
         File f = LittleFS.open("/badrequest.html", "r");
 
-        time_t localTime = timechangerules::timezones[settings::timeZone]->toLocal(now(), &tcr);
+        time_t localTime = timeService::Local();
 
         String htmlString;
 
@@ -436,9 +763,9 @@ namespace network
         }
         f.close();
 
-        htmlString.replace("%year%", (String)year(localTime));
+        htmlString.replace(F("%year%"), (String)year(localTime));
 
-        webServer.send(200, "text/html", htmlString);
+        webServer.send(200, FPSTR(TEXT_HTML), htmlString);
     }
 
     void InitWifiWebServer()
@@ -446,15 +773,34 @@ namespace network
         //  Web server
         if (MDNS.begin(settings::localHost))
         {
-            Serial.printf("MDNS responder with hostname %s started.\r\n", settings::localHost);
+            Serial.printf_P(PSTR("MDNS responder with hostname %s started.\r\n"), settings::localHost);
         }
 
+        //  Building a page takes several KB of heap, with little left the answer is a short refusal
+        webServer.addHook([](const String &method, const String &url, WiFiClient *client, ESP8266WebServer::ContentTypeFunction contentType)
+                          {
+            if (!heap::RejectWebRequests())
+                return ESP8266WebServer::CLIENT_REQUEST_CAN_CONTINUE;
+
+            client->print(FPSTR(SERVICE_UNAVAILABLE));
+            client->stop();
+            return ESP8266WebServer::CLIENT_REQUEST_IS_HANDLED; });
+
         //  Page handles
         webServer.on("/", handleStatus);
         webServer.on("/login.html", handleLogin);
         webServer.on("/status.html", handleStatus);
         webServer.on("/generalsettings.html", handleGeneralSettings);
         webServer.on("/sensors.html", handleSensors);
+        webServer.on("/sensorstats.json", handleSensorStatistics);
+        webServer.on("/history.json", handleHistory);
+        webServer.on("/datalog.csv", []()
+                     { handleDataLog(false); });
+        webServer.on("/datalog.json", []()
+                     { handleDataLog(true); });
+#ifdef __loopProfiling
+        webServer.on("/profile.json", handleProfile);
+#endif
         webServer.on("/networksettings.html", handleNetworkSettings);
         webServer.on("/tools.html", handleTools);
 
@@ -469,13 +815,22 @@ namespace network
             []()
             {
                 HTTPUpload &upload = webServer.upload();
+                //  /update?target=fs takes a LittleFS image instead of firmware, &md5=<hex> verifies either
+                bool filesystemImage = webServer.arg(F("target")) == "fs";
+
                 if (upload.status == UPLOAD_FILE_START)
                 {
-                    Serial.printf("Update: %s\n", upload.filename.c_str());
-                    if (!Update.begin(UPDATE_SIZE_UNKNOWN))
+                    //  .bin and .bin.gz both work, eboot unpacks compressed images when it installs them.
+                    //  A filesystem image is staged in the free flash first, so it usually has to be compressed.
+                    Serial.printf_P(PSTR("Update: %s\n"), upload.filename.c_str());
+                    if (!(filesystemImage ? filesystem::BeginImageUpdate(0, upload.filename.c_str()) : Update.begin(UPDATE_SIZE_UNKNOWN)))
                     { // start with max available size
                         Update.printError(Serial);
                     }
+                    else if (webServer.hasArg(F("md5")))
+                    {
+                        Update.setMD5(webServer.arg(F("md5")).c_str());
+                    }
                 }
                 else if (upload.status == UPLOAD_FILE_WRITE)
                 {
@@ -487,9 +842,9 @@ namespace network
                 }
                 else if (upload.status == UPLOAD_FILE_END)
                 {
-                    if (Update.end(true))
+                    if (filesystemImage ? filesystem::EndImageUpdate(true) : Update.end(true))
                     { // true to set the size to the current progress
-                        Serial.printf("Update Success: %u\nRebooting...\n", upload.totalSize);
+                        Serial.printf_P(PSTR("Update Success: %u\nRebooting...\n"), upload.totalSize);
                         ESP.restart();
                     }
                     else
@@ -497,12 +852,21 @@ namespace network
                         Update.printError(Serial);
                     }
                 }
+                else if (upload.status == UPLOAD_FILE_ABORTED)
+                {
+                    //  Nothing is committed, the running firmware and filesystem stay as they are
+                    Serial.println(F("Update aborted."));
+                    if (filesystemImage)
+                        filesystem::AbortImageUpdate();
+                    else if (Update.isRunning())
+                        Update.end();
+                }
                 yield();
             });
 
         //  Start HTTP (web) server
         webServer.begin();
-        Serial.println("HTTP server started.");
+        Serial.println(F("HTTP server started."));
 
         //  Authenticate HTTP requests
         const char *headerkeys[] = {"User-Agent", "Cookie"};
@@ -1,14 +1,15 @@
 #include <ESP8266WiFi.h>
 #include <WiFiUdp.h>
 #include <TimeLib.h>
-
-#define DEBUG_NTPClient
-#include <NTPClient.h>
+#include <lwip/dns.h>
 
 #include "ntp.h"
 #include "common.h"
+#include "connection.h"
+
+#define DEBUG_NTPClient
 
-#define NTP_UPDATE_INTERVAL_MS 360000 //  synchronize time with NTP server once an hour
+#define NTP_UNIX_OFFSET 2208988800UL //  seconds from 1900 to 1970
 
 namespace ntp
 {
@@ -20,19 +21,303 @@ namespace ntp
     char timeServer[] = "pool.ntp.org";
 #endif
 
-    NTPClient timeClient(ntpUDP, timeServer, 0, NTP_UPDATE_INTERVAL_MS);
+    bool initialized = false;
+
+    //  The server is looked up asynchronously and the address is kept until a sync fails
+    IPAddress serverIP;
+    bool serverResolved = false;
+    bool resolvePending = false;
+    volatile bool resolveAnswered = false;
+    volatile bool resolveFound = false;
+    uint32_t resolveGeneration = 0;
+
+    //  The clock: epoch ms at an anchor on the local counter, plus the elapsed local time
+    //  corrected by the measured crystal drift
+    bool synced = false;
+    uint64_t anchorEpochUs = 0;
+    uint64_t anchorLocalUs = 0;
+    int32_t driftPpb = 0; //  how much the local counter runs fast (+) or slow (-)
+    uint64_t lastEpochMs = 0;
+
+    //  Request in flight
+    bool requestPending = false;
+    uint64_t requestLocalUs = 0;
+    uint32_t lastAttemptMillis = 0;
+    uint32_t nextSyncSeconds = 0;
+
+    //  Sync quality
+    int32_t lastOffsetMs = 0;
+    uint32_t lastDelayMs = 0;
+    uint32_t lastSyncMillis = 0;
+    uint32_t syncs = 0;
+    uint32_t failures = 0;
+
+    //  The core keeps a 64-bit microsecond counter that does not wrap
+    uint64_t Micros64()
+    {
+        return micros64();
+    }
+
+    int64_t CorrectedElapsedUs(uint64_t localUs)
+    {
+        int64_t elapsed = localUs - anchorLocalUs;
+        return elapsed - elapsed * driftPpb / 1000000000LL;
+    }
+
+    uint64_t EpochUsAt(uint64_t localUs)
+    {
+        return anchorEpochUs + CorrectedElapsedUs(localUs);
+    }
+
+    bool IsSynced()
+    {
+        return synced;
+    }
+
+    //  Never goes backwards, a correction that would is absorbed by holding the clock
+    uint64_t EpochMs()
+    {
+        if (!synced)
+            return 0;
+
+        uint64_t epochMs = EpochUsAt(Micros64()) / 1000;
+        if (epochMs < lastEpochMs)
+            return lastEpochMs;
+
+        lastEpochMs = epochMs;
+        return epochMs;
+    }
+
+    //  TimeLib follows the corrected clock through this
+    time_t SyncProvider()
+    {
+        return synced ? EpochMs() / 1000 : 0;
+    }
+
+    //  NTP 32.32 fixed point, seconds since 1900
+    uint64_t ReadTimestampUs(const uint8_t *p)
+    {
+        uint32_t seconds = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+        uint32_t fraction = (uint32_t)p[4] << 24 | (uint32_t)p[5] << 16 | (uint32_t)p[6] << 8 | p[7];
+
+        return (uint64_t)(seconds - NTP_UNIX_OFFSET) * 1000000 + (((uint64_t)fraction * 1000000) >> 32);
+    }
+
+    //  Only a server that could not be reached says something about the connection,
+    //  an answer that is not trusted does not
+    void SyncFailed(bool answered = false)
+    {
+        requestPending = false;
+        failures++;
+        nextSyncSeconds = NTP_RETRY_INTERVAL;
+        serverResolved = false; //  a pool may have moved on, look it up again next time
+        if (!answered)
+            connection::ReportFailure();
+    }
+
+    void DnsFoundCallback(const char *name, const ip_addr_t *ipaddr, void *arg)
+    {
+        //  Answers to a lookup that already timed out are ignored
+        if ((uint32_t)arg != resolveGeneration)
+            return;
+
+        resolveFound = ipaddr != nullptr;
+        if (resolveFound)
+            serverIP = IPAddress(ipaddr);
+        resolveAnswered = true;
+    }
+
+    void StartResolve()
+    {
+        ip_addr_t address;
+
+        resolveGeneration++;
+        resolveAnswered = false;
+        lastAttemptMillis = millis();
+
+        if (serverIP.fromString(timeServer))
+        {
+            serverResolved = true;
+            return;
+        }
+
+        err_t result = dns_gethostbyname(timeServer, &address, DnsFoundCallback, (void *)resolveGeneration);
+
+        if (result == ERR_INPROGRESS)
+        {
+            resolvePending = true;
+            return;
+        }
+
+        if (result == ERR_OK)
+        {
+            serverIP = IPAddress(&address);
+            serverResolved = true;
+        }
+        else
+            SyncFailed();
+    }
+
+    void CheckResolve()
+    {
+        if (!resolveAnswered)
+        {
+            if (millis() - lastAttemptMillis < NTP_TIMEOUT)
+                return;
+            resolveGeneration++;
+        }
+
+        resolvePending = false;
+
+        if (resolveAnswered && resolveFound)
+            serverResolved = true;
+        else
+            SyncFailed();
+    }
+
+    void SendRequest()
+    {
+        uint8_t packet[NTP_PACKET_SIZE];
+        memset(packet, 0, sizeof(packet));
+        packet[0] = 0b00100011; //  LI 0, version 4, client
+
+        //  Stale answers to an earlier request are thrown away
+        while (ntpUDP.parsePacket())
+            ntpUDP.flush();
+
+        lastAttemptMillis = millis();
+
+        if (!ntpUDP.beginPacket(serverIP, NTP_PORT))
+        {
+            SyncFailed();
+            return;
+        }
+        ntpUDP.write(packet, sizeof(packet));
+
+        requestLocalUs = Micros64();
+        requestPending = ntpUDP.endPacket();
+        if (!requestPending)
+            SyncFailed();
+    }
+
+    void Synced(uint64_t serverEpochUs, uint64_t localUs)
+    {
+        if (synced)
+        {
+            //  Drift: how far the corrected clock got from the server since the last sync
+            int64_t errorUs = (int64_t)(EpochUsAt(localUs) - serverEpochUs);
+            int64_t elapsedUs = localUs - anchorLocalUs;
+
+            lastOffsetMs = -errorUs / 1000;
+
+            if (elapsedUs > 30000000LL)
+            {
+                int64_t measuredPpb = driftPpb + errorUs * 1000000000LL / elapsedUs;
+
+                if (llabs(measuredPpb) <= NTP_MAX_DRIFT_PPM * 1000LL)
+                    driftPpb = syncs < NTP_LEARNING_SYNCS ? measuredPpb : (driftPpb * 3 + measuredPpb) / 4;
+            }
+        }
+
+        anchorEpochUs = serverEpochUs;
+        anchorLocalUs = localUs;
+        synced = true;
+
+        syncs++;
+        lastSyncMillis = millis();
+        nextSyncSeconds = syncs < NTP_LEARNING_SYNCS ? NTP_LEARNING_INTERVAL : NTP_SYNC_INTERVAL;
+
+        setTime(EpochMs() / 1000);
+    }
+
+    void ReadAnswer()
+    {
+        uint64_t t4 = Micros64();
+
+        if (ntpUDP.parsePacket() < NTP_PACKET_SIZE)
+        {
+            if (t4 - requestLocalUs > NTP_TIMEOUT * 1000ULL)
+                SyncFailed();
+            return;
+        }
+
+        uint8_t packet[NTP_PACKET_SIZE];
+        ntpUDP.read(packet, sizeof(packet));
+        requestPending = false;
+
+        //  Server mode, synchronized (stratum 1..15)
+        if ((packet[0] & 0x07) != 4 || packet[1] == 0 || packet[1] > 15)
+        {
+            SyncFailed(true);
+            return;
+        }
+
+        uint64_t t1 = requestLocalUs;
+        uint64_t t2 = ReadTimestampUs(packet + 32); //  server receive
+        uint64_t t3 = ReadTimestampUs(packet + 40); //  server transmit
+
+        int64_t delayUs = (int64_t)(t4 - t1) - (int64_t)(t3 - t2);
+        if (delayUs < 0 || delayUs > NTP_MAX_DELAY * 1000LL)
+        {
+            SyncFailed(true);
+            return;
+        }
+
+        lastDelayMs = delayUs / 1000;
+
+        //  The server time at t4 is its transmit time plus half the round trip
+        Synced(t3 + delayUs / 2, t4);
+    }
+
+    void ToJson(JsonObject obj)
+    {
+        obj["Synced"] = synced;
+        obj["OffsetMs"] = lastOffsetMs;
+        obj["DelayMs"] = lastDelayMs;
+        obj["LastSyncAge"] = synced ? (millis() - lastSyncMillis) / 1000 : 0;
+        obj["DriftPpm"] = driftPpb / 1000.0;
+        obj["Syncs"] = syncs;
+        obj["Failures"] = failures;
+    }
 
     void setup()
     {
-        timeClient.begin();
+        if (initialized)
+            return;
+
+        ntpUDP.begin(0);
+        setSyncProvider(SyncProvider);
+        setSyncInterval(60);
+
+        initialized = true;
     }
 
+    //  Runs often so the arrival of the answer is timestamped closely
     void loop()
     {
-        timeClient.update();
-        if (timeClient.isTimeSet())
+        if (!initialized)
+            return;
+
+        if (requestPending)
+        {
+            ReadAnswer();
+            return;
+        }
+
+        if (resolvePending)
         {
-            setTime(timeClient.getEpochTime());
+            CheckResolve();
+            if (serverResolved)
+                SendRequest();
+            return;
         }
+
+        if (millis() - lastAttemptMillis < nextSyncSeconds * 1000UL)
+            return;
+
+        if (!serverResolved)
+            StartResolve();
+        if (serverResolved)
+            SendRequest();
     }
-}
\ No newline at end of file
+}
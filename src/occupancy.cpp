@@ -0,0 +1,141 @@
+#include <Arduino.h>
+#include <TimeLib.h>
+
+#include "occupancy.h"
+#include "settings.h"
+#include "mqtt.h"
+#include "datalog.h"
+#include "timeService.h"
+
+namespace occupancy
+{
+    OCCUPANCY_STATES state = STATE_VACANT;
+
+    bool motionActive = false;
+    uint32_t motionStartMillis = 0;
+    uint32_t motionEndMillis = 0;
+    uint32_t occupiedSinceMillis = 0;
+
+    //  Rollup of the current interval
+    uint32_t intervalStartMillis = 0;
+    uint32_t occupiedMillis = 0;
+    uint32_t triggers = 0;
+    uint32_t filteredTriggers = 0;
+
+    //  Only transitions are published: the retained PIR0 state and a timestamped event
+    void PublishTransition(bool occupied, uint32_t eventMillis)
+    {
+        char time[EPOCH_MS_STRING_LENGTH];
+        char payload[64];
+
+        timeService::FormatEpochMs(timeService::EpochMs() - (millis() - eventMillis), time);
+        sprintf(payload, "{\"State\":\"%s\",\"Time\":%s}", occupied ? "on" : "off", time);
+
+        mqtt::PublishData("PIR0", occupied ? "on" : "off", true);
+        mqtt::PublishData("events/PIR0", payload, false);
+        datalog::LogEvent(DATALOG_CHANNEL_PIR, occupied);
+    }
+
+    //  Time spent occupied within the current rollup interval
+    uint32_t OccupiedSpan(uint32_t untilMillis)
+    {
+        uint32_t from = (int32_t)(occupiedSinceMillis - intervalStartMillis) > 0 ? occupiedSinceMillis : intervalStartMillis;
+        return (int32_t)(untilMillis - from) > 0 ? untilMillis - from : 0;
+    }
+
+    void SetOccupied(uint32_t eventMillis)
+    {
+        state = STATE_OCCUPIED;
+        occupiedSinceMillis = eventMillis;
+        PublishTransition(true, eventMillis);
+    }
+
+    void SetVacant(uint32_t eventMillis)
+    {
+        occupiedMillis += OccupiedSpan(eventMillis);
+        state = STATE_VACANT;
+        PublishTransition(false, eventMillis);
+    }
+
+    void MotionStarted(uint32_t captureMillis)
+    {
+        motionActive = true;
+        motionStartMillis = captureMillis;
+        triggers++;
+
+        if (state == STATE_VACANT)
+        {
+            if (settings::pirMinOnTime == 0)
+                SetOccupied(captureMillis);
+            else
+                state = STATE_PENDING;
+        }
+    }
+
+    void MotionEnded(uint32_t captureMillis)
+    {
+        motionActive = false;
+        motionEndMillis = captureMillis;
+
+        //  Motion shorter than the minimum on time is treated as noise
+        if (state == STATE_PENDING)
+        {
+            state = STATE_VACANT;
+            filteredTriggers++;
+        }
+    }
+
+    void PublishRollup()
+    {
+        uint32_t nowMillis = millis();
+        uint32_t occupied = occupiedMillis + (state == STATE_OCCUPIED ? OccupiedSpan(nowMillis) : 0);
+        char payload[128];
+
+        snprintf(payload, sizeof(payload), "{\"Interval\":%u,\"OccupiedSeconds\":%u,\"Triggers\":%u,\"FilteredTriggers\":%u}",
+                 (nowMillis - intervalStartMillis) / 1000, occupied / 1000, triggers, filteredTriggers);
+
+        mqtt::PublishData("occupancy/rollup", payload, false);
+
+        intervalStartMillis = nowMillis;
+        occupiedMillis = 0;
+        triggers = 0;
+        filteredTriggers = 0;
+    }
+
+    void ToJson(JsonObject obj)
+    {
+        obj["State"] = state == STATE_OCCUPIED ? "on" : "off";
+        obj["Triggers"] = triggers;
+        obj["OccupiedSeconds"] = (occupiedMillis + (state == STATE_OCCUPIED ? OccupiedSpan(millis()) : 0)) / 1000;
+    }
+
+    void setup()
+    {
+        intervalStartMillis = millis();
+    }
+
+    void loop()
+    {
+        uint32_t nowMillis = millis();
+
+        switch (state)
+        {
+        case STATE_PENDING:
+            if (motionActive && nowMillis - motionStartMillis >= settings::pirMinOnTime)
+                SetOccupied(motionStartMillis);
+            break;
+
+        case STATE_OCCUPIED:
+            //  Every new trigger keeps the area occupied, the hold time runs from the last motion
+            if (!motionActive && nowMillis - motionEndMillis >= settings::pirHoldTime * 1000UL)
+                SetVacant(motionEndMillis + settings::pirHoldTime * 1000UL);
+            break;
+
+        default:
+            break;
+        }
+
+        if (nowMillis - intervalStartMillis >= settings::pirRollupInterval * 1000UL)
+            PublishRollup();
+    }
+}
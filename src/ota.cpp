@@ -1,209 +1,372 @@
 #include <Arduino.h>
-#include <ESP8266httpUpdate.h>
+#include <ESP8266WiFi.h>
+#include <ESP8266HTTPClient.h>
 #include <ArduinoOTA.h>
+#include <ArduinoJson.h>
+#include <bearssl/bearssl_hash.h>
 
+#include "version.h"
+#include "ota.h"
+#include "settings.h"
 #include "network.h"
+#include "mqtt.h"
+#include "logger.h"
 #include "leds.h"
+#include "filesystem.h"
+#include "arena.h"
 
 #define OTA_BLINKING_RATE 3
 
 namespace ota
 {
+    struct otaManifest
+    {
+        char version[32];
+        uint32_t size;
+        uint8_t sha256[32];
+        char url[128];
+        bool filesystem;
+    } manifest;
 
-    String host = "diy.viktak.com";
-    String bin = "/firmware.bin"; // bin file name with a slash in front.
-    const int port = 80;
-    int contentLength = 0;
-    bool isValidContentType = false;
+    OTA_STATES state = OTA_IDLE;
 
-    String getHeaderValue(const String header, const String headerName)
-    {
-        return header.substring(strlen(headerName.c_str()));
-    }
+    //  Set by CheckForUpdate, the ota task fetches it
+    char pendingManifestUrl[sizeof(manifest.url)];
+    bool pendingForce = false;
+
+    WiFiClient otaClient;
+    HTTPClient http;
+    WiFiClient *stream = nullptr;
+
+    br_sha256_context sha256;
+    uint32_t written = 0;
+    uint8_t resumes = 0;
+    uint32_t stateMillis = 0;
+    uint32_t lastDataMillis = 0;
+    uint8_t lastReportedProgress = 0;
+    bool compressed = false;
+    const char *lastError = "";
+
+    const char *stateNames[] = {"idle", "checking", "downloading", "resuming", "restarting", "failed"};
 
     void initOTA()
     {
         ArduinoOTA.onStart([]()
-                           { Serial.println("OTA started.\r\n"); });
+                           { Serial.println(F("OTA started.\r\n")); });
 
         ArduinoOTA.onEnd([]()
-                         { Serial.println("\r\nOTA finished.\r\n"); });
+                         { Serial.println(F("\r\nOTA finished.\r\n")); });
 
         ArduinoOTA.onProgress([](unsigned int progress, unsigned int total)
                               {
-                            Serial.printf("Progress: %u%%\r", (progress / (total / 100)));
+                            Serial.printf_P(PSTR("Progress: %u%%\r"), (progress / (total / 100)));
                             if (progress % OTA_BLINKING_RATE == 0) leds::connectionLED_TOGGLE(); });
 
         ArduinoOTA.onError([](ota_error_t error)
                            {
-                            Serial.printf("Error[%u]: ", error);
-                            if (error == OTA_AUTH_ERROR) Serial.println("Authentication failed.");
-                            else if (error == OTA_BEGIN_ERROR) Serial.println("Begin failed.");
-                            else if (error == OTA_CONNECT_ERROR) Serial.println("Connect failed.");
-                            else if (error == OTA_RECEIVE_ERROR) Serial.println("Receive failed.");
-                            else if (error == OTA_END_ERROR) Serial.println("End failed."); });
+                            Serial.printf_P(PSTR("Error[%u]: "), error);
+                            if (error == OTA_AUTH_ERROR) Serial.println(F("Authentication failed."));
+                            else if (error == OTA_BEGIN_ERROR) Serial.println(F("Begin failed."));
+                            else if (error == OTA_CONNECT_ERROR) Serial.println(F("Connect failed."));
+                            else if (error == OTA_RECEIVE_ERROR) Serial.println(F("Receive failed."));
+                            else if (error == OTA_END_ERROR) Serial.println(F("End failed.")); });
 
         ArduinoOTA.begin();
 
 #ifdef __debugSettings
-        Serial.println("ArduinoOTA started.");
+        Serial.println(F("ArduinoOTA started."));
 #endif
     }
 
-    void execOTA()
+    void ToJson(JsonObject obj)
+    {
+        obj["State"] = stateNames[state];
+        obj["Target"] = manifest.filesystem ? "filesystem" : "firmware";
+        obj["Version"] = manifest.version;
+        obj["Size"] = manifest.size;
+        obj["Written"] = written;
+        obj["Compressed"] = compressed;
+        obj["Resumes"] = resumes;
+        obj["Error"] = lastError;
+    }
+
+    void PublishStatus()
+    {
+        arena::scope scope;
+        arena::jsonDocument doc(256);
+        char *payload = (char *)arena::Allocate(256);
+        if (!payload)
+            return;
+
+        ToJson(doc.to<JsonObject>());
+        serializeJson(doc, payload, 256);
+        mqtt::PublishData("ota/status", payload, false);
+    }
+
+    void SetState(OTA_STATES newState)
+    {
+        state = newState;
+        stateMillis = millis();
+        PublishStatus();
+    }
+
+    void Fail(const char *error)
     {
-        Serial.println("Connecting to: " + String(host));
-        // Connect to S3
-        if (network::client.connect(host.c_str(), port))
+        lastError = error;
+        http.end();
+        stream = nullptr;
+
+        Serial.printf_P(PSTR("OTA failed: %s\r\n"), error);
+        logger::LogEvent(logger::System, 11, "OTA failed", error, logger::LEVEL_ERROR);
+
+        //  The updater cannot be reset once it has started, only a restart clears it.
+        //  The running firmware is untouched until Update.end().
+        if (Update.isRunning())
         {
-            // Connection Succeed.
-            // Fecthing the bin
-            Serial.println("Fetching Bin: " + String(bin));
+            if (manifest.filesystem)
+                filesystem::AbortImageUpdate();
 
-            // Get the contents of the bin file
-            network::client.print(String("GET ") + bin + " HTTP/1.1\r\n" +
-                                  "Host: " + host + "\r\n" +
-                                  "Cache-Control: no-cache\r\n" +
-                                  "Connection: close\r\n\r\n");
+            SetState(OTA_RESTARTING);
+            return;
+        }
 
-            // Check what is being sent
-            //    Serial.print(String("GET ") + bin + " HTTP/1.1\r\n" +
-            //                 "Host: " + host + "\r\n" +
-            //                 "Cache-Control: no-cache\r\n" +
-            //                 "Connection: close\r\n\r\n");
+        SetState(OTA_FAILED);
+    }
 
-            unsigned long timeout = millis();
-            while (network::client.available() == 0)
-            {
-                if (millis() - timeout > 5000)
-                {
-                    Serial.println("Client Timeout !");
-                    network::client.stop();
-                    return;
-                }
-            }
-            // Once the response is available,
-            // check stuff
+    bool HexToBytes(const char *hex, uint8_t *dest, size_t length)
+    {
+        if (!hex || strlen(hex) != length * 2)
+            return false;
 
-            while (network::client.available())
-            {
-                // read line till /n
-                String line = network::client.readStringUntil('\n');
-                // remove space, to check if the line is end of headers
-                line.trim();
-
-                // if the the line is empty,
-                // this is end of headers
-                // break the while and feed the
-                // remaining `client` to the
-                // Update.writeStream();
-                if (!line.length())
-                {
-                    // headers ended
-                    break; // and get the OTA started
-                }
-
-                // Check if the HTTP Response is 200
-                // else break and Exit Update
-                if (line.startsWith("HTTP/1.1"))
-                {
-                    if (line.indexOf("200") < 0)
-                    {
-                        Serial.println("Got a non 200 status code from server. Exiting OTA Update.");
-                        break;
-                    }
-                }
-
-                // extract headers here
-                // Start with content length
-                if (line.startsWith("Content-Length: "))
-                {
-                    contentLength = atol((getHeaderValue(line, "Content-Length: ")).c_str());
-                    Serial.println("Got " + String(contentLength) + " bytes from server");
-                }
-
-                // Next, the content type
-                if (line.startsWith("Content-Type: "))
-                {
-                    String contentType = getHeaderValue(line, "Content-Type: ");
-                    Serial.println("Got " + contentType + " payload.");
-                    if (contentType == "application/octet-stream")
-                    {
-                        isValidContentType = true;
-                    }
-                }
-            }
+        for (size_t i = 0; i < length; i++)
+        {
+            char byte[3] = {hex[i * 2], hex[i * 2 + 1], 0};
+            char *end;
+            dest[i] = strtoul(byte, &end, 16);
+            if (*end)
+                return false;
         }
-        else
+        return true;
+    }
+
+    //  The image URL may be relative to the manifest
+    void ResolveUrl(const char *manifestUrl, const char *url, char *dest, size_t size)
+    {
+        if (strstr(url, "://"))
         {
-            // Connect to S3 failed
-            // May be try?
-            // Probably a choppy network?
-            Serial.println("Connection to " + String(host) + " failed. Please check your setup");
-            // retry??
-            // execOTA();
+            strlcpy(dest, url, size);
+            return;
         }
 
-        // Check what is the contentLength and if content type is `application/octet-stream`
-        Serial.println("contentLength : " + String(contentLength) + ", isValidContentType : " + String(isValidContentType));
+        strlcpy(dest, manifestUrl, size);
+        char *lastSlash = strrchr(dest, '/');
+        if (lastSlash)
+            lastSlash[1] = 0;
+        strlcat(dest, url, size);
+    }
 
-        // check contentLength and content type
-        if (contentLength && isValidContentType)
+    bool FetchManifest(const char *manifestUrl)
+    {
+        http.setTimeout(OTA_HTTP_TIMEOUT);
+        if (!http.begin(otaClient, manifestUrl))
+            return false;
+
+        int code = http.GET();
+        if (code != HTTP_CODE_OK)
         {
-            // Check if there is enough to OTA Update
-            bool canBegin = Update.begin(contentLength);
+            http.end();
+            return false;
+        }
 
-            // If yes, begin
-            if (canBegin)
-            {
-                Serial.println("Begin OTA. This may take 2 - 5 mins to complete. Things might be quiet for a while.. Patience!");
-                // No activity would appear on the Serial monitor
-                // So be patient. This may take 2 - 5mins to complete
-                size_t written = Update.writeStream(network::client);
-
-                if (written == (size_t)contentLength)
-                {
-                    Serial.println("Written : " + String(written) + " successfully");
-                }
-                else
-                {
-                    Serial.println("Written only : " + String(written) + "/" + String(contentLength) + ". Retry?");
-                    // retry??
-                    // execOTA();
-                }
-
-                if (Update.end())
-                {
-                    Serial.println("OTA done!");
-                    if (Update.isFinished())
-                    {
-                        Serial.println("Update successfully completed. Rebooting.");
-                        ESP.restart();
-                    }
-                    else
-                    {
-                        Serial.println("Update not finished? Something went wrong!");
-                    }
-                }
-                else
-                {
-                    Serial.println("Error Occurred. Error #: " + String(Update.getError()));
-                }
-            }
-            else
-            {
-                // not enough space to begin OTA
-                // Understand the partitions and
-                // space availability
-                Serial.println("Not enough space to begin OTA");
-                network::client.flush();
-            }
+        arena::jsonDocument doc(384);
+        DeserializationError error = deserializeJson(doc, http.getStream());
+        http.end();
+
+        if (error)
+            return false;
+
+        strlcpy(manifest.version, doc["version"] | "", sizeof(manifest.version));
+        manifest.size = doc["size"] | 0;
+        manifest.filesystem = !strcmp(doc["target"] | "firmware", "filesystem");
+        ResolveUrl(manifestUrl, doc["url"] | (manifest.filesystem ? "littlefs.bin" : "firmware.bin"), manifest.url, sizeof(manifest.url));
+
+        return manifest.version[0] && manifest.size && HexToBytes(doc["sha256"], manifest.sha256, sizeof(manifest.sha256));
+    }
+
+    //  Continues where the previous connection stopped
+    bool OpenStream()
+    {
+        http.end();
+        http.setTimeout(OTA_HTTP_TIMEOUT);
+        if (!http.begin(otaClient, manifest.url))
+            return false;
+
+        if (written)
+        {
+            char range[24];
+            sprintf(range, "bytes=%u-", written);
+            http.addHeader("Range", range);
         }
-        else
+
+        int code = http.GET();
+        if (code != (written ? HTTP_CODE_PARTIAL_CONTENT : HTTP_CODE_OK))
         {
-            Serial.println("There was no content in the response");
-            network::client.flush();
+            Serial.printf_P(PSTR("OTA: HTTP %d for %s\r\n"), code, manifest.url);
+            http.end();
+            return false;
         }
+
+        stream = http.getStreamPtr();
+        lastDataMillis = millis();
+        return true;
+    }
+
+    //  Only queues the check, so callers such as the MQTT callback never wait for HTTP
+    bool CheckForUpdate(const char *manifestUrl, bool force)
+    {
+        if (state != OTA_IDLE && state != OTA_FAILED)
+            return false;
+
+        strlcpy(pendingManifestUrl, manifestUrl, sizeof(pendingManifestUrl));
+        pendingForce = force;
+        lastError = "";
+
+        SetState(OTA_MANIFEST);
+        return true;
+    }
+
+    //  Runs from the ota task
+    void StartUpdate(const char *manifestUrl, bool force)
+    {
+        if (!FetchManifest(manifestUrl))
+        {
+            Fail("manifest");
+            return;
+        }
+
+        String runningVersion = manifest.filesystem ? filesystem::ImageVersion() : String(FIRMWARE_VERSION);
+        if (!force && runningVersion == manifest.version)
+        {
+            Serial.printf_P(PSTR("OTA: %s %s is up to date.\r\n"), manifest.filesystem ? "filesystem" : "firmware", manifest.version);
+            SetState(OTA_IDLE);
+            return;
+        }
+
+        if (!manifest.filesystem && manifest.size > ESP.getFreeSketchSpace())
+        {
+            Fail("too large");
+            return;
+        }
+
+        if (!(manifest.filesystem ? filesystem::BeginImageUpdate(manifest.size, manifest.version) : Update.begin(manifest.size, U_FLASH)))
+        {
+            Fail("begin");
+            return;
+        }
+
+        br_sha256_init(&sha256);
+        written = 0;
+        compressed = false;
+        resumes = 0;
+        lastReportedProgress = 0;
+
+        Serial.printf_P(PSTR("OTA: downloading %s (%u bytes) from %s\r\n"), manifest.version, manifest.size, manifest.url);
+        logger::LogEvent(logger::System, 10, "OTA started", manifest.version);
+
+        if (!OpenStream())
+        {
+            SetState(OTA_RESUME_WAIT);
+            return;
+        }
+
+        SetState(OTA_DOWNLOADING);
+    }
+
+    void Finish()
+    {
+        http.end();
+        stream = nullptr;
+
+        uint8_t digest[32];
+        br_sha256_out(&sha256, digest);
+
+        //  Update.end() is the commit, it only happens with a matching hash
+        if (memcmp(digest, manifest.sha256, sizeof(digest)))
+        {
+            Fail("sha256 mismatch");
+            return;
+        }
+
+        if (!(manifest.filesystem ? filesystem::EndImageUpdate(false) : Update.end()))
+        {
+            Fail("commit");
+            return;
+        }
+
+        Serial.println(F("OTA: update verified, restarting."));
+        logger::LogEvent(logger::System, 12, "OTA done", manifest.version);
+        SetState(OTA_RESTARTING);
+    }
+
+    void ResumeLater()
+    {
+        http.end();
+        stream = nullptr;
+
+        if (++resumes > OTA_MAX_RESUMES)
+        {
+            Fail("download");
+            return;
+        }
+
+        Serial.printf_P(PSTR("OTA: connection lost at %u bytes, resuming.\r\n"), written);
+        SetState(OTA_RESUME_WAIT);
+    }
+
+    //  One chunk per call, the rest of the node keeps running during the download
+    void Download()
+    {
+        size_t available = stream->available();
+
+        if (!available)
+        {
+            if (!stream->connected() || millis() - lastDataMillis > OTA_STALL_TIMEOUT)
+                ResumeLater();
+            return;
+        }
+
+        //  Too large for the stack, the chunk is only needed during this call
+        arena::scope scope;
+        uint8_t *buffer = (uint8_t *)arena::Allocate(OTA_CHUNK_SIZE);
+        if (!buffer)
+            return;
+
+        size_t length = stream->readBytes(buffer, min(min(available, (size_t)OTA_CHUNK_SIZE), (size_t)(manifest.size - written)));
+
+        //  eboot unpacks gzip images when it installs them, the updater takes them as they are
+        if (!written && length >= 2)
+            compressed = buffer[0] == 0x1F && buffer[1] == 0x8B;
+
+        br_sha256_update(&sha256, buffer, length);
+        if (Update.write(buffer, length) != length)
+        {
+            Fail("flash write");
+            return;
+        }
+
+        written += length;
+        lastDataMillis = millis();
+        leds::connectionLED_TOGGLE();
+
+        uint8_t progress = (uint64_t)written * 10 / manifest.size;
+        if (progress != lastReportedProgress)
+        {
+            lastReportedProgress = progress;
+            PublishStatus();
+        }
+
+        if (written >= manifest.size)
+            Finish();
     }
 
     void setup(){
@@ -213,5 +376,38 @@ namespace ota
     void loop()
     {
         ArduinoOTA.handle();
+
+        switch (state)
+        {
+        case OTA_MANIFEST:
+            StartUpdate(pendingManifestUrl, pendingForce);
+            break;
+
+        case OTA_DOWNLOADING:
+            Download();
+            break;
+
+        case OTA_RESUME_WAIT:
+            if (millis() - stateMillis > (uint32_t)OTA_RESUME_DELAY << min(resumes, (uint8_t)4))
+            {
+                if (OpenStream())
+                    SetState(OTA_DOWNLOADING);
+                else
+                    ResumeLater();
+            }
+            break;
+
+        case OTA_RESTARTING:
+            //  Gives the status message and the log a moment to leave
+            if (millis() - stateMillis > 1000)
+            {
+                logger::Flush();
+                ESP.restart();
+            }
+            break;
+
+        default:
+            break;
+        }
     }
 }
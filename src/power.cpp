@@ -0,0 +1,279 @@
+#include <Arduino.h>
+#include <TimeLib.h>
+
+#include "power.h"
+#include "common.h"
+#include "settings.h"
+#include "connection.h"
+#include "mqtt.h"
+#include "tempSensors.h"
+#include "filters.h"
+#include "datalog.h"
+#include "logger.h"
+
+#define POWER_MAGIC 0x504F5752        //  "POWR"
+#define SENSOR_CACHE_MAGIC 0x53454E53 //  "SENS"
+
+namespace power
+{
+    //  Kept in RTC memory over deep sleep (RTC_POWER)
+    struct powerRecord
+    {
+        uint32_t magic;
+        uint32_t cycles;
+        uint32_t awakeMsTotal;
+        uint32_t sleepSecondsTotal;
+        uint32_t lastAwakeMs;
+        uint32_t lastSleepSeconds;
+        uint32_t epochAtSleep;          //  0 if the time was not set
+        uint32_t heartbeatSleepSeconds; //  slept since the last heartbeat
+        logState datalog;               //  the data log carries on in the same segment
+        uint32_t checksum;
+    } record;
+
+    //  Filter state of the sensors over deep sleep (RTC_SENSOR_CACHE)
+    struct sensorCache
+    {
+        uint32_t magic;
+        uint32_t addressHash; //  the cache belongs to this set of sensors only
+        uint32_t count;       //  of the sensors, only the first POWER_CACHED_SENSORS are kept
+        uint32_t checksum;
+        filterSnapshot snapshots[POWER_CACHED_SENSORS];
+    };
+
+    static_assert(sizeof(powerRecord) <= (common::RTC_SENSOR_CACHE - common::RTC_POWER) * 4, "powerRecord overlaps RTC_SENSOR_CACHE");
+    static_assert(sizeof(sensorCache) <= (common::RTC_NEXT_FREE_BLOCK - common::RTC_SENSOR_CACHE) * 4, "sensorCache overlaps the next RTC block");
+    static_assert(common::RTC_NEXT_FREE_BLOCK <= common::RTC_USER_BLOCKS, "RTC layout exceeds the user memory");
+
+    enum WAKE_STATES
+    {
+        WAKE_WAITING_FOR_NETWORK,
+        WAKE_PUBLISHING,
+        WAKE_DONE
+    } wakeState = WAKE_WAITING_FOR_NETWORK;
+
+    bool wokeFromDeepSleep = false;
+    uint32_t wakeMillis = 0;
+
+    //  Modem sleep statistics
+    uint64_t idleMicros = 0;
+    uint64_t busyMicros = 0;
+    uint32_t lastIdleEndMicros = 0;
+
+    uint32_t Checksum(const uint32_t *words, size_t count)
+    {
+        uint32_t checksum = 0xFFFFFFFF;
+        while (count--)
+            checksum ^= *words++;
+        return checksum;
+    }
+
+    uint32_t AddressHash()
+    {
+        uint32_t hash = 0;
+        for (uint8_t i = 0; i < tempSensors::oneWireDevicesCount; i++)
+            for (uint8_t b = 0; b < sizeof(DeviceAddress); b++)
+                hash = hash * 31 + tempSensors::thermometers[i].deviceAddress[b];
+        return hash;
+    }
+
+    uint32_t CachedSensors(uint32_t count)
+    {
+        return min(count, (uint32_t)POWER_CACHED_SENSORS);
+    }
+
+    //  Only as many snapshots as there are sensors are written and read
+    size_t SensorCacheSize(uint32_t cached)
+    {
+        return offsetof(sensorCache, snapshots) + cached * sizeof(filterSnapshot);
+    }
+
+    void SaveSensorCache()
+    {
+        sensorCache c;
+
+        c.magic = SENSOR_CACHE_MAGIC;
+        c.addressHash = AddressHash();
+        c.count = tempSensors::oneWireDevicesCount;
+
+        uint32_t cached = CachedSensors(c.count);
+        for (uint8_t i = 0; i < cached; i++)
+            filters::GetSnapshot(i, c.snapshots[i]);
+        c.checksum = Checksum((uint32_t *)c.snapshots, cached * sizeof(filterSnapshot) / 4) ^ c.addressHash;
+
+        ESP.rtcUserMemoryWrite(common::RTC_SENSOR_CACHE, (uint32_t *)&c, SensorCacheSize(cached));
+    }
+
+    void RestoreSensorCache()
+    {
+        sensorCache c;
+
+        ESP.rtcUserMemoryRead(common::RTC_SENSOR_CACHE, (uint32_t *)&c, SensorCacheSize(0));
+        if (c.magic != SENSOR_CACHE_MAGIC || c.count != tempSensors::oneWireDevicesCount || c.addressHash != AddressHash())
+            return;
+
+        uint32_t cached = CachedSensors(c.count);
+        ESP.rtcUserMemoryRead(common::RTC_SENSOR_CACHE, (uint32_t *)&c, SensorCacheSize(cached));
+        if (c.checksum != (Checksum((uint32_t *)c.snapshots, cached * sizeof(filterSnapshot) / 4) ^ c.addressHash))
+            return;
+
+        for (uint8_t i = 0; i < cached; i++)
+            filters::RestoreSnapshot(i, c.snapshots[i]);
+    }
+
+    void SaveRecord()
+    {
+        record.magic = POWER_MAGIC;
+        record.checksum = Checksum((uint32_t *)&record, offsetof(powerRecord, checksum) / 4);
+        ESP.rtcUserMemoryWrite(common::RTC_POWER, (uint32_t *)&record, sizeof(record));
+    }
+
+    void LoadRecord()
+    {
+        ESP.rtcUserMemoryRead(common::RTC_POWER, (uint32_t *)&record, sizeof(record));
+
+        if (record.magic != POWER_MAGIC || record.checksum != Checksum((uint32_t *)&record, offsetof(powerRecord, checksum) / 4))
+            memset(&record, 0, sizeof(record));
+    }
+
+    WiFiSleepType_t RadioSleepMode()
+    {
+        return settings::powerMode == POWER_MODEM_SLEEP ? WIFI_MODEM_SLEEP : WIFI_NONE_SLEEP;
+    }
+
+    void ToJson(JsonObject obj)
+    {
+        static const char *modes[] = {"AlwaysOn", "ModemSleep", "DeepSleep"};
+        obj["Mode"] = modes[settings::powerMode <= POWER_DEEP_SLEEP ? settings::powerMode : 0];
+
+        if (settings::powerMode == POWER_DEEP_SLEEP)
+        {
+            uint64_t totalMs = (uint64_t)record.sleepSecondsTotal * 1000 + record.awakeMsTotal;
+
+            obj["Cycles"] = record.cycles;
+            obj["LastAwakeMs"] = record.lastAwakeMs;
+            obj["AvgAwakeMs"] = record.cycles ? record.awakeMsTotal / record.cycles : 0;
+            obj["DutyCyclePermille"] = totalMs ? (uint32_t)((uint64_t)record.awakeMsTotal * 1000 / totalMs) : 1000;
+        }
+        else if (settings::powerMode == POWER_MODEM_SLEEP)
+        {
+            uint64_t total = busyMicros + idleMicros;
+            obj["BusyPermille"] = total ? (uint32_t)(busyMicros * 1000 / total) : 1000;
+        }
+    }
+
+    void GoToSleep()
+    {
+        uint32_t awakeMs = millis();
+        uint32_t sleepSeconds = settings::temperatureRefreshInterval;
+
+        //  The deep sleep timer cannot go beyond a few hours
+        if ((uint64_t)sleepSeconds * 1000000 > ESP.deepSleepMax())
+            sleepSeconds = ESP.deepSleepMax() / 1000000;
+
+        //  The count only starts over once a heartbeat has actually gone out
+        if (mqtt::heartbeatSent)
+            record.heartbeatSleepSeconds = 0;
+
+        record.cycles++;
+        record.awakeMsTotal += awakeMs;
+        record.sleepSecondsTotal += sleepSeconds;
+        record.heartbeatSleepSeconds += sleepSeconds;
+        record.lastAwakeMs = awakeMs;
+        record.lastSleepSeconds = sleepSeconds;
+        record.epochAtSleep = timeStatus() == timeNotSet ? 0 : now();
+
+        datalog::Flush();
+        datalog::GetState(record.datalog);
+        SaveRecord();
+
+        SaveSensorCache();
+        logger::Flush();
+        mqtt::Disconnect();
+
+        Serial.printf_P(PSTR("Awake for %u ms, sleeping for %u s.\r\n"), awakeMs, sleepSeconds);
+
+        ESP.deepSleep((uint64_t)sleepSeconds * 1000000, WAKE_RF_DEFAULT);
+    }
+
+    void setup()
+    {
+        wokeFromDeepSleep = ESP.getResetInfoPtr()->reason == REASON_DEEP_SLEEP_AWAKE;
+        wakeMillis = millis();
+
+        if (settings::powerMode != POWER_DEEP_SLEEP)
+            return;
+
+        LoadRecord();
+
+        if (!wokeFromDeepSleep)
+            return;
+
+        RestoreSensorCache();
+
+        //  Good enough until NTP answers: the sleep timer drifts a few percent at most
+        if (record.epochAtSleep)
+            setTime(record.epochAtSleep + record.lastSleepSeconds + millis() / 1000);
+
+        datalog::Resume(record.datalog);
+
+        if (record.heartbeatSleepSeconds >= settings::heartbeatInterval)
+            mqtt::needsHeartbeat = true;
+    }
+
+    //  Deep sleep mode: read and publish as soon as the network is up, then sleep again.
+    //  After a power-on or reset the node stays awake for a while so it can be configured.
+    void loop()
+    {
+        if (settings::powerMode != POWER_DEEP_SLEEP)
+            return;
+
+        uint32_t awake = millis() - wakeMillis;
+
+        if (!wokeFromDeepSleep)
+        {
+            if (awake >= POWER_CONFIG_WINDOW)
+                GoToSleep();
+            return;
+        }
+
+        switch (wakeState)
+        {
+        case WAKE_WAITING_FOR_NETWORK:
+            //  Readings taken offline still go to the history and the data log
+            if (connection::isInternetConnected || awake >= POWER_MAX_AWAKE)
+            {
+                tempSensors::ReadTemperatures();
+                wakeState = WAKE_PUBLISHING;
+            }
+            break;
+
+        case WAKE_PUBLISHING:
+            //  The mqtt task sends the heartbeat when one is due
+            if (!mqtt::needsHeartbeat || !connection::isInternetConnected || awake >= POWER_MAX_AWAKE)
+                wakeState = WAKE_DONE;
+            break;
+
+        case WAKE_DONE:
+            GoToSleep();
+            break;
+        }
+    }
+
+    //  Called after every scheduler pass. In modem sleep mode the loop rests, the radio
+    //  sleeps between beacons on its own; interrupts keep being served meanwhile.
+    void Idle()
+    {
+        if (settings::powerMode != POWER_MODEM_SLEEP)
+            return;
+
+        uint32_t start = micros();
+        if (lastIdleEndMicros)
+            busyMicros += start - lastIdleEndMicros;
+
+        delay(POWER_IDLE_DELAY);
+
+        lastIdleEndMicros = micros();
+        idleMicros += lastIdleEndMicros - start;
+    }
+}
@@ -0,0 +1,266 @@
+#include <Arduino.h>
+#include <LittleFS.h>
+
+#include "pulseCounter.h"
+#include "common.h"
+#include "settings.h"
+#include "mqtt.h"
+#include "datalog.h"
+
+#define HALL_SENSOR 13
+
+#define PULSE_FILE "/pulses.bin"
+#define PULSE_SAVE_INTERVAL 600 //  seconds between flash writes of the total
+#define PULSE_FAST_WINDOW 10    //  seconds, used for the change detection
+#define PULSE_MAGIC 0x50554C53  //  "PULS"
+
+namespace pulseCounter
+{
+    struct pulseRecord
+    {
+        uint32_t magic;
+        uint32_t totalLow;
+        uint32_t totalHigh;
+        uint32_t checksum;
+    };
+
+    static_assert(sizeof(pulseRecord) <= (common::RTC_WIFI_CACHE - common::RTC_PULSE_COUNTER) * 4, "pulseRecord overlaps RTC_WIFI_CACHE");
+
+    //  Written by the interrupt only
+    volatile uint32_t isrPulses = 0;
+    volatile uint32_t isrRejected = 0;
+    volatile uint32_t isrLastPulseMicros = 0;
+    uint32_t debounceMicros = DEFAULT_HALL_DEBOUNCE;
+
+    uint32_t windowCounts[PULSE_WINDOW_SECONDS];
+    uint8_t windowHead = 0;
+    uint8_t windowFilled = 0;
+
+    uint32_t lastSnapshot = 0;
+    unsigned long lastSampleMillis = 0;
+
+    uint64_t totalPulses = 0;
+    uint64_t savedTotal = 0;
+    uint64_t publishedTotal = 0;
+    uint32_t publishedMilliHz = 0;
+    unsigned long lastPublishMillis = 0;
+    unsigned long lastSaveMillis = 0;
+
+    void IRAM_ATTR HallISR()
+    {
+        uint32_t pulseMicros = micros();
+
+        if (pulseMicros - isrLastPulseMicros < debounceMicros)
+        {
+            isrRejected++;
+            return;
+        }
+
+        isrLastPulseMicros = pulseMicros;
+        isrPulses++;
+    }
+
+    void MakeRecord(pulseRecord &r)
+    {
+        r.magic = PULSE_MAGIC;
+        r.totalLow = (uint32_t)totalPulses;
+        r.totalHigh = (uint32_t)(totalPulses >> 32);
+        r.checksum = r.magic ^ r.totalLow ^ r.totalHigh ^ 0xFFFFFFFF;
+    }
+
+    bool CheckRecord(const pulseRecord &r, uint64_t &total)
+    {
+        if (r.magic != PULSE_MAGIC || r.checksum != (r.magic ^ r.totalLow ^ r.totalHigh ^ 0xFFFFFFFF))
+            return false;
+
+        total = ((uint64_t)r.totalHigh << 32) | r.totalLow;
+        return true;
+    }
+
+    //  RTC memory is updated every second and keeps the exact count over a reset,
+    //  the file is written rarely to spare the flash and covers power loss.
+    void SaveToRtc()
+    {
+        pulseRecord r;
+        MakeRecord(r);
+        ESP.rtcUserMemoryWrite(common::RTC_PULSE_COUNTER, (uint32_t *)&r, sizeof(r));
+    }
+
+    void SaveToFlash()
+    {
+        if (totalPulses == savedTotal)
+            return;
+
+        pulseRecord r;
+        MakeRecord(r);
+
+        File f = LittleFS.open(PULSE_FILE, "w");
+        if (!f)
+        {
+            Serial.println(F("Failed to open pulse counter file for writing"));
+            return;
+        }
+        f.write((uint8_t *)&r, sizeof(r));
+        f.close();
+
+        savedTotal = totalPulses;
+    }
+
+    void LoadTotal()
+    {
+        pulseRecord r;
+        uint64_t rtcTotal = 0, flashTotal = 0;
+
+        ESP.rtcUserMemoryRead(common::RTC_PULSE_COUNTER, (uint32_t *)&r, sizeof(r));
+        bool rtcValid = CheckRecord(r, rtcTotal);
+
+        File f = LittleFS.open(PULSE_FILE, "r");
+        if (f)
+        {
+            if (f.read((uint8_t *)&r, sizeof(r)) == sizeof(r))
+                CheckRecord(r, flashTotal);
+            f.close();
+        }
+
+        totalPulses = rtcValid && rtcTotal > flashTotal ? rtcTotal : flashTotal;
+        savedTotal = flashTotal;
+        publishedTotal = totalPulses;
+    }
+
+    void ResetTotal()
+    {
+        totalPulses = 0;
+        publishedTotal = 0;
+        savedTotal = 1; //  force the write
+        SaveToRtc();
+        SaveToFlash();
+    }
+
+    //  Moves the pulses counted by the interrupt into the per-second window. When the
+    //  loop was held up for several seconds the pulses are spread evenly over them.
+    void Sample()
+    {
+        unsigned long elapsed = (millis() - lastSampleMillis) / 1000;
+        if (elapsed == 0)
+            return;
+
+        lastSampleMillis += elapsed * 1000;
+
+        uint32_t snapshot = isrPulses;
+        uint32_t pulses = snapshot - lastSnapshot;
+        lastSnapshot = snapshot;
+
+        totalPulses += pulses;
+
+        //  The share per second comes from the whole gap, only its last seconds fit the window
+        unsigned long first = elapsed > PULSE_WINDOW_SECONDS ? elapsed - PULSE_WINDOW_SECONDS : 0;
+
+        for (unsigned long i = first; i < elapsed; i++)
+        {
+            windowCounts[windowHead] = pulses / elapsed + (i < pulses % elapsed ? 1 : 0);
+            windowHead = (windowHead + 1) % PULSE_WINDOW_SECONDS;
+            if (windowFilled < PULSE_WINDOW_SECONDS)
+                windowFilled++;
+        }
+
+        SaveToRtc();
+    }
+
+    //  Average rate over the last windowSeconds, in 1/1000 Hz
+    uint32_t GetMilliHz(uint16_t windowSeconds)
+    {
+        if (windowSeconds > windowFilled)
+            windowSeconds = windowFilled;
+        if (windowSeconds == 0)
+            return 0;
+
+        uint64_t sum = 0;
+        for (uint16_t i = 1; i <= windowSeconds; i++)
+            sum += windowCounts[(windowHead + PULSE_WINDOW_SECONDS - i) % PULSE_WINDOW_SECONDS];
+
+        return sum * 1000 / windowSeconds;
+    }
+
+    //  Revolutions per minute in 1/10 RPM
+    uint32_t MilliHzToDeciRpm(uint32_t milliHz)
+    {
+        return (uint64_t)milliHz * 60 / 100 / settings::hallPulsesPerRevolution;
+    }
+
+    void ToJson(JsonObject obj)
+    {
+        char total[21];
+        common::Uint64ToString(totalPulses, total);
+
+        obj["Frequency"] = GetMilliHz(PULSE_WINDOW_SECONDS) / 1000.0;
+        obj["RPM"] = MilliHzToDeciRpm(GetMilliHz(PULSE_WINDOW_SECONDS)) / 10.0;
+        obj["Total"] = serialized(String(total));
+        obj["Rejected"] = isrRejected;
+    }
+
+    void Publish(uint32_t milliHz)
+    {
+        char total[21];
+        char payload[160];
+
+        common::Uint64ToString(totalPulses, total);
+
+        uint32_t fastMilliHz = GetMilliHz(PULSE_FAST_WINDOW);
+        uint32_t deciRpm = MilliHzToDeciRpm(milliHz);
+
+        snprintf(payload, sizeof(payload), "{\"Frequency\":%u.%03u,\"Frequency10s\":%u.%03u,\"RPM\":%u.%u,\"Total\":%s,\"Rejected\":%u}",
+                 milliHz / 1000, milliHz % 1000, fastMilliHz / 1000, fastMilliHz % 1000, deciRpm / 10, deciRpm % 10, total, isrRejected);
+
+        mqtt::PublishData("hall", payload, false);
+
+        uint64_t pulses = totalPulses - publishedTotal;
+        datalog::LogValue(DATALOG_CHANNEL_HALL, pulses > INT16_MAX ? INT16_MAX : (int16_t)pulses);
+
+        publishedTotal = totalPulses;
+        publishedMilliHz = GetMilliHz(PULSE_FAST_WINDOW);
+        lastPublishMillis = millis();
+    }
+
+    //  A rate that moved more than hallChangeThreshold % from the last published one is sent right away
+    bool SignificantChange()
+    {
+        if (settings::hallChangeThreshold == 0)
+            return false;
+
+        uint32_t milliHz = GetMilliHz(PULSE_FAST_WINDOW);
+        uint32_t difference = milliHz > publishedMilliHz ? milliHz - publishedMilliHz : publishedMilliHz - milliHz;
+
+        if (publishedMilliHz == 0)
+            return milliHz != 0;
+
+        return (uint64_t)difference * 100 > (uint64_t)settings::hallChangeThreshold * publishedMilliHz;
+    }
+
+    void setup()
+    {
+        debounceMicros = settings::hallDebounce;
+
+        LoadTotal();
+
+        pinMode(HALL_SENSOR, INPUT_PULLUP);
+        attachInterrupt(digitalPinToInterrupt(HALL_SENSOR), HallISR, FALLING);
+
+        lastSampleMillis = millis();
+        lastSaveMillis = millis();
+        lastPublishMillis = millis();
+    }
+
+    void loop()
+    {
+        Sample();
+
+        if (millis() - lastPublishMillis > settings::hallPublishInterval * 1000UL || SignificantChange())
+            Publish(GetMilliHz(PULSE_WINDOW_SECONDS));
+
+        if (millis() - lastSaveMillis > PULSE_SAVE_INTERVAL * 1000UL)
+        {
+            SaveToFlash();
+            lastSaveMillis = millis();
+        }
+    }
+}
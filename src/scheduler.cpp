@@ -0,0 +1,161 @@
+#include <Arduino.h>
+
+#include "scheduler.h"
+#include "connection.h"
+#include "heap.h"
+
+namespace scheduler
+{
+    task tasks[SCHEDULER_MAX_TASKS];
+    uint8_t taskCount = 0;
+
+#ifdef __loopProfiling
+    uint32_t lastPassMicros = 0;
+    uint32_t maxLoopGapUs = 0;
+    uint32_t passes = 0;
+    uint32_t watchdogNearMisses = 0;
+
+    void Profile(task &t, uint32_t elapsedUs)
+    {
+        uint8_t bucket = 0;
+        for (uint32_t limit = 100; bucket < PROFILE_BUCKETS - 1 && elapsedUs >= limit; limit *= 10)
+            bucket++;
+
+        t.histogram[bucket]++;
+        t.totalUs += elapsedUs;
+        if (elapsedUs > t.worstUs)
+            t.worstUs = elapsedUs;
+
+        //  Tasks yield only when they return, so a long task is a long time without a yield
+        if (elapsedUs > WATCHDOG_NEAR_MISS_MS * 1000UL)
+            watchdogNearMisses++;
+    }
+
+    void ProfileToJson(JsonObject obj, bool detailed)
+    {
+        obj["Passes"] = passes;
+        obj["MaxLoopGapUs"] = maxLoopGapUs;
+        obj["WatchdogNearMisses"] = watchdogNearMisses;
+
+        JsonObject taskList = obj.createNestedObject("Tasks");
+        for (uint8_t i = 0; i < taskCount; i++)
+        {
+            const task &t = tasks[i];
+
+            if (!detailed)
+            {
+                taskList[t.name] = t.worstUs;
+                continue;
+            }
+
+            JsonObject details = taskList.createNestedObject(t.name);
+            details["Runs"] = t.runs;
+            details["AvgUs"] = t.runs ? (uint32_t)(t.totalUs / t.runs) : 0;
+            details["WorstUs"] = t.worstUs;
+            details["BudgetUs"] = t.budgetUs;
+            details["Overruns"] = t.overruns;
+            details["Deferrals"] = t.deferrals;
+
+            JsonArray histogram = details.createNestedArray("Histogram");
+            for (uint8_t b = 0; b < PROFILE_BUCKETS; b++)
+                histogram.add(t.histogram[b]);
+        }
+    }
+#endif
+
+    //  Tasks are kept sorted by priority, so a pass simply walks the table
+    bool AddTask(const char *name, void (*callback)(), uint32_t periodMs, uint8_t priority, uint32_t budgetUs, uint8_t gate)
+    {
+        if (taskCount >= SCHEDULER_MAX_TASKS)
+        {
+            Serial.printf_P(PSTR("Error: Too many tasks, %s not scheduled.\r\n"), name);
+            return false;
+        }
+
+        uint8_t position = taskCount;
+        while (position > 0 && tasks[position - 1].priority > priority)
+        {
+            tasks[position] = tasks[position - 1];
+            position--;
+        }
+
+        task &t = tasks[position];
+        t.name = name;
+        t.callback = callback;
+        t.periodMs = periodMs;
+        t.budgetUs = budgetUs;
+        t.priority = priority;
+        t.gate = gate;
+        t.lastRunMillis = millis() - periodMs;
+        t.runs = 0;
+        t.overruns = 0;
+        t.deferrals = 0;
+        t.minFreeHeap = UINT32_MAX;
+#ifdef __loopProfiling
+        memset(t.histogram, 0, sizeof(t.histogram));
+        t.worstUs = 0;
+        t.totalUs = 0;
+#endif
+
+        taskCount++;
+        return true;
+    }
+
+    bool GateOpen(uint8_t gate)
+    {
+        switch (gate)
+        {
+        case GATE_WIFI:
+            return connection::isWiFiConnected;
+        case GATE_INTERNET:
+            return connection::isInternetConnected;
+        default:
+            return true;
+        }
+    }
+
+    void loop()
+    {
+        uint32_t passStart = micros();
+
+#ifdef __loopProfiling
+        if (passes++ && passStart - lastPassMicros > maxLoopGapUs)
+            maxLoopGapUs = passStart - lastPassMicros;
+        lastPassMicros = passStart;
+#endif
+
+        for (uint8_t i = 0; i < taskCount; i++)
+        {
+            task &t = tasks[i];
+
+            if (millis() - t.lastRunMillis < t.periodMs || !GateOpen(t.gate))
+                continue;
+
+            if (t.priority != PRIORITY_CRITICAL && micros() - passStart > SCHEDULER_PASS_BUDGET_US)
+            {
+                t.deferrals++;
+                continue;
+            }
+
+            uint32_t start = micros();
+            t.lastRunMillis = millis();
+            heap::TaskStarted();
+            t.callback();
+            t.runs++;
+
+            uint32_t lowWater = heap::TaskLowWater();
+            if (lowWater < t.minFreeHeap)
+                t.minFreeHeap = lowWater;
+
+            uint32_t elapsed = micros() - start;
+            if (elapsed > t.budgetUs)
+                t.overruns++;
+
+#ifdef __loopProfiling
+            Profile(t, elapsed);
+#endif
+
+            yield();
+        }
+    }
+}
@@ -7,6 +7,7 @@
 #include "common.h"
 #include "settings.h"
 #include "logger.h"
+#include "arena.h"
 
 #define DEFAULT_TIMEZONE 13
 
@@ -16,6 +17,11 @@ namespace settings
     char wifiSSID[22];
     char wifiPassword[32] = "";
 
+    char staticIP[16] = "";
+    char staticGateway[16] = "";
+    char staticSubnet[16] = "";
+    char staticDNS[16] = "";
+
     char adminPassword[32] = DEFAULT_ADMIN_PASSWORD;
 
     char nodeFriendlyName[32] = DEFAULT_NODE_FRIENDLY_NAME;
@@ -28,6 +34,33 @@ namespace settings
     char mqttTopic[32];
 
     int temperatureRefreshInterval = DEFAULT_TEMPERATURE_REFRESH_INTERVAL;
+    uint16_t internetCheckInterval = DEFAULT_INTERNET_CHECK_INTERVAL;
+    uint8_t powerMode = DEFAULT_POWER_MODE;
+    uint16_t heapLowBlock = DEFAULT_HEAP_LOW_BLOCK;
+    uint8_t heapAction = DEFAULT_HEAP_ACTION;
+
+    uint8_t logMqttLevel = DEFAULT_LOG_MQTT_LEVEL;
+    uint8_t logSyslogLevel = DEFAULT_LOG_UDP_LEVEL;
+    uint8_t logBinaryLevel = DEFAULT_LOG_UDP_LEVEL;
+    char logServer[64] = "";
+    uint16_t logSyslogPort = DEFAULT_LOG_SYSLOG_PORT;
+    uint16_t logBinaryPort = DEFAULT_LOG_BINARY_PORT;
+
+    char otaManifestUrl[96] = DEFAULT_OTA_MANIFEST_URL;
+
+    uint8_t filterMedianWindow = DEFAULT_FILTER_MEDIAN_WINDOW;
+    uint16_t filterEmaWeight = DEFAULT_FILTER_EMA_WEIGHT;
+    uint16_t filterMaxRate = DEFAULT_FILTER_MAX_RATE;
+    uint16_t filterDeadband = DEFAULT_FILTER_DEADBAND;
+
+    uint16_t hallDebounce = DEFAULT_HALL_DEBOUNCE;
+    uint16_t hallPulsesPerRevolution = DEFAULT_HALL_PULSES_PER_REVOLUTION;
+    uint16_t hallPublishInterval = DEFAULT_HALL_PUBLISH_INTERVAL;
+    uint8_t hallChangeThreshold = DEFAULT_HALL_CHANGE_THRESHOLD;
+
+    uint16_t pirHoldTime = DEFAULT_PIR_HOLD_TIME;
+    uint16_t pirMinOnTime = DEFAULT_PIR_MIN_ON_TIME;
+    uint16_t pirRollupInterval = DEFAULT_PIR_ROLLUP_INTERVAL;
 
     //  Calculated values
     char accessPointPassword[32];
@@ -41,32 +74,38 @@ namespace settings
         File configFile = LittleFS.open("/config.json", "r");
         if (!configFile)
         {
-            Serial.println("Failed to open config file.");
+            Serial.println(F("Failed to open config file."));
             return false;
         }
 
         size_t size = configFile.size();
-        if (size > 1024)
+        if (size > 2048)
         {
-            Serial.println("Config file size is too large.");
+            Serial.println(F("Config file size is too large."));
             return false;
         }
 
-        // Allocate a buffer to store contents of the file.
-        std::unique_ptr<char[]> buf(new char[size]);
+        // The file and the document are only needed while the settings are read
+        arena::scope scope;
+        char *buf = (char *)arena::Allocate(size);
+        if (!buf)
+        {
+            configFile.close();
+            return false;
+        }
 
         // We don't use String here because ArduinoJson library requires the input
         // buffer to be mutable. If you don't use ArduinoJson, you may as well
         // use configFile.readString instead.
-        configFile.readBytes(buf.get(), size);
+        configFile.readBytes(buf, size);
         configFile.close();
 
-        StaticJsonDocument<768> doc;
-        DeserializationError error = deserializeJson(doc, buf.get());
+        arena::jsonDocument doc(1536);
+        DeserializationError error = deserializeJson(doc, buf, size);
 
         if (error)
         {
-            Serial.println("Failed to parse config file.");
+            Serial.println(F("Failed to parse config file."));
             Serial.println(error.c_str());
             return false;
         }
@@ -90,6 +129,14 @@ namespace settings
             strcpy(wifiPassword, doc["password"]);
         }
 
+        if (doc["staticIP"])
+        {
+            strlcpy(staticIP, doc["staticIP"], sizeof(staticIP));
+            strlcpy(staticGateway, doc["staticGateway"] | "", sizeof(staticGateway));
+            strlcpy(staticSubnet, doc["staticSubnet"] | "", sizeof(staticSubnet));
+            strlcpy(staticDNS, doc["staticDNS"] | "", sizeof(staticDNS));
+        }
+
         if (doc["accessPointPassword"])
         {
             strcpy(accessPointPassword, doc["accessPointPassword"]);
@@ -134,6 +181,98 @@ namespace settings
             temperatureRefreshInterval = doc["temperatureRefreshInterval"];
         }
 
+        if (doc["internetCheckInterval"])
+        {
+            internetCheckInterval = doc["internetCheckInterval"];
+        }
+
+        if (doc["powerMode"])
+        {
+            powerMode = doc["powerMode"];
+        }
+
+        if (doc["heapLowBlock"])
+        {
+            heapLowBlock = doc["heapLowBlock"];
+        }
+
+        //  0 only monitors, so presence is checked instead of the value
+        if (doc.containsKey("heapAction"))
+        {
+            heapAction = doc["heapAction"];
+        }
+
+        //  0 is a valid level (debug), so presence is checked instead of the value
+        if (doc.containsKey("logMqttLevel"))
+        {
+            logMqttLevel = doc["logMqttLevel"];
+            logSyslogLevel = doc["logSyslogLevel"] | DEFAULT_LOG_UDP_LEVEL;
+            logBinaryLevel = doc["logBinaryLevel"] | DEFAULT_LOG_UDP_LEVEL;
+            strlcpy(logServer, doc["logServer"] | "", sizeof(logServer));
+            logSyslogPort = doc["logSyslogPort"] | DEFAULT_LOG_SYSLOG_PORT;
+            logBinaryPort = doc["logBinaryPort"] | DEFAULT_LOG_BINARY_PORT;
+        }
+
+        if (doc["otaManifestUrl"])
+        {
+            strlcpy(otaManifestUrl, doc["otaManifestUrl"], sizeof(otaManifestUrl));
+        }
+
+        if (doc["filterMedianWindow"])
+        {
+            filterMedianWindow = doc["filterMedianWindow"];
+        }
+
+        if (doc["filterEmaWeight"])
+        {
+            filterEmaWeight = doc["filterEmaWeight"];
+        }
+
+        if (doc.containsKey("filterMaxRate"))
+        {
+            filterMaxRate = doc["filterMaxRate"];
+        }
+
+        if (doc.containsKey("filterDeadband"))
+        {
+            filterDeadband = doc["filterDeadband"];
+        }
+
+        if (doc.containsKey("hallDebounce"))
+        {
+            hallDebounce = doc["hallDebounce"];
+        }
+
+        if (doc["hallPulsesPerRevolution"])
+        {
+            hallPulsesPerRevolution = doc["hallPulsesPerRevolution"];
+        }
+
+        if (doc["hallPublishInterval"])
+        {
+            hallPublishInterval = doc["hallPublishInterval"];
+        }
+
+        if (doc.containsKey("hallChangeThreshold"))
+        {
+            hallChangeThreshold = doc["hallChangeThreshold"];
+        }
+
+        if (doc.containsKey("pirHoldTime"))
+        {
+            pirHoldTime = doc["pirHoldTime"];
+        }
+
+        if (doc.containsKey("pirMinOnTime"))
+        {
+            pirMinOnTime = doc["pirMinOnTime"];
+        }
+
+        if (doc["pirRollupInterval"])
+        {
+            pirRollupInterval = doc["pirRollupInterval"];
+        }
+
         if (strcmp(localHost, mqttTopic) != 0)
         {
             char mac[7];
@@ -175,12 +314,17 @@ namespace settings
 
     bool SaveSettings()
     {
-        StaticJsonDocument<384> doc;
+        arena::jsonDocument doc(1536);
 
         doc["ssid"] = wifiSSID;
         doc["password"] = wifiPassword;
         doc["accessPointPassword"] = accessPointPassword;
 
+        doc["staticIP"] = staticIP;
+        doc["staticGateway"] = staticGateway;
+        doc["staticSubnet"] = staticSubnet;
+        doc["staticDNS"] = staticDNS;
+
         doc["heartbeatInterval"] = heartbeatInterval;
 
         doc["timezone"] = timeZone;
@@ -193,6 +337,34 @@ namespace settings
 
         doc["temperatureRefreshInterval"] = temperatureRefreshInterval;
 
+        doc["internetCheckInterval"] = internetCheckInterval;
+        doc["powerMode"] = powerMode;
+        doc["heapLowBlock"] = heapLowBlock;
+        doc["heapAction"] = heapAction;
+
+        doc["logMqttLevel"] = logMqttLevel;
+        doc["logSyslogLevel"] = logSyslogLevel;
+        doc["logBinaryLevel"] = logBinaryLevel;
+        doc["logServer"] = logServer;
+        doc["logSyslogPort"] = logSyslogPort;
+        doc["logBinaryPort"] = logBinaryPort;
+
+        doc["otaManifestUrl"] = otaManifestUrl;
+
+        doc["filterMedianWindow"] = filterMedianWindow;
+        doc["filterEmaWeight"] = filterEmaWeight;
+        doc["filterMaxRate"] = filterMaxRate;
+        doc["filterDeadband"] = filterDeadband;
+
+        doc["hallDebounce"] = hallDebounce;
+        doc["hallPulsesPerRevolution"] = hallPulsesPerRevolution;
+        doc["hallPublishInterval"] = hallPublishInterval;
+        doc["hallChangeThreshold"] = hallChangeThreshold;
+
+        doc["pirHoldTime"] = pirHoldTime;
+        doc["pirMinOnTime"] = pirMinOnTime;
+        doc["pirRollupInterval"] = pirRollupInterval;
+
 #ifdef __debugSettings
         serializeJsonPretty(doc, Serial);
         Serial.println();
@@ -201,7 +373,7 @@ namespace settings
         File configFile = LittleFS.open("/config.json", "w");
         if (!configFile)
         {
-            Serial.println("Failed to open config file for writing");
+            Serial.println(F("Failed to open config file for writing"));
             return false;
         }
         serializeJson(doc, configFile);
@@ -216,6 +388,12 @@ namespace settings
 
         strcpy(wifiSSID, localHost);
         strcpy(wifiPassword, DEFAULT_AP_PASSWORD);
+
+        staticIP[0] = 0;
+        staticGateway[0] = 0;
+        staticSubnet[0] = 0;
+        staticDNS[0] = 0;
+
         strcpy(mqttServer, DEFAULT_MQTT_SERVER);
 
         strcpy(accessPointPassword, DEFAULT_AP_PASSWORD);
@@ -230,15 +408,43 @@ namespace settings
         heartbeatInterval = DEFAULT_HEARTBEAT_INTERVAL;
         temperatureRefreshInterval = DEFAULT_TEMPERATURE_REFRESH_INTERVAL;
 
+        internetCheckInterval = DEFAULT_INTERNET_CHECK_INTERVAL;
+        powerMode = DEFAULT_POWER_MODE;
+        heapLowBlock = DEFAULT_HEAP_LOW_BLOCK;
+        heapAction = DEFAULT_HEAP_ACTION;
+
+        logMqttLevel = DEFAULT_LOG_MQTT_LEVEL;
+        logSyslogLevel = DEFAULT_LOG_UDP_LEVEL;
+        logBinaryLevel = DEFAULT_LOG_UDP_LEVEL;
+        logServer[0] = 0;
+        logSyslogPort = DEFAULT_LOG_SYSLOG_PORT;
+        logBinaryPort = DEFAULT_LOG_BINARY_PORT;
+
+        strcpy(otaManifestUrl, DEFAULT_OTA_MANIFEST_URL);
+
+        filterMedianWindow = DEFAULT_FILTER_MEDIAN_WINDOW;
+        filterEmaWeight = DEFAULT_FILTER_EMA_WEIGHT;
+        filterMaxRate = DEFAULT_FILTER_MAX_RATE;
+        filterDeadband = DEFAULT_FILTER_DEADBAND;
+
+        hallDebounce = DEFAULT_HALL_DEBOUNCE;
+        hallPulsesPerRevolution = DEFAULT_HALL_PULSES_PER_REVOLUTION;
+        hallPublishInterval = DEFAULT_HALL_PUBLISH_INTERVAL;
+        hallChangeThreshold = DEFAULT_HALL_CHANGE_THRESHOLD;
+
+        pirHoldTime = DEFAULT_PIR_HOLD_TIME;
+        pirMinOnTime = DEFAULT_PIR_MIN_ON_TIME;
+        pirRollupInterval = DEFAULT_PIR_ROLLUP_INTERVAL;
+
         if (!SaveSettings())
         {
-            Serial.println("Failed to save config!");
+            Serial.println(F("Failed to save config!"));
         }
         else
         {
             ESP.restart();
 #ifdef __debugSettings
-            Serial.println("Settings saved.");
+            Serial.println(F("Settings saved."));
 #endif
         }
     }
@@ -5,10 +5,22 @@
 #include "tempSensors.h"
 #include "settings.h"
 #include "mqtt.h"
+#include "history.h"
+#include "datalog.h"
+#include "filters.h"
+#include "boot.h"
 
 #define ONE_WIRE_GPIO 2
 #define DS1820_RESOLUTION 12
 
+#define DS18S20_FAMILY_CODE 0x10
+#define SCRATCHPAD_TEMP_LSB 0
+#define SCRATCHPAD_TEMP_MSB 1
+#define SCRATCHPAD_CRC_BYTE 8
+#define POWER_ON_RESET_RAW 0x0550 //  85.0 °C in 1/16 °C units
+
+#define THERMOMETERS_TOPIC "thermometers/"
+
 namespace tempSensors
 {
     uint8_t oneWireDevicesCount;
@@ -18,32 +30,78 @@ namespace tempSensors
 
     unsigned long oldTemperatureMillis = 0;
 
-    String OneWireDeviceAddress2HEX(DeviceAddress deviceAddress, char Separator)
+    enum READ_RESULTS
     {
-        static const char *hexDigits = "0123456789ABCDEF";
+        READ_OK,
+        READ_DISCONNECTED,
+        READ_CRC_ERROR,
+        READ_POWER_ON_RESET
+    };
 
-        uint8_t h;
-        String result = "";
+    void OneWireDeviceAddress2HEX(const DeviceAddress deviceAddress, char Separator, char *dest)
+    {
+        static const char *hexDigits = "0123456789ABCDEF";
 
         for (uint8_t i = 0; i < 8; i++)
         {
-            h = deviceAddress[i] / 16;
-            result += hexDigits[h];
-            result += hexDigits[deviceAddress[i] % 16];
+            *dest++ = hexDigits[deviceAddress[i] >> 4];
+            *dest++ = hexDigits[deviceAddress[i] & 0x0F];
             if (i < 7)
-                result += Separator;
+                *dest++ = Separator;
+        }
+        *dest = 0;
+    }
+
+    //  Formats a 1/16 °C value with two decimals (rounded) without going through float.
+    //  dest must hold at least TEMPERATURE_STRING_LENGTH bytes. Returns the length written.
+    size_t FormatTemperature(int16_t raw, char *dest)
+    {
+        char *p = dest;
+
+        if (raw == TEMPERATURE_INVALID)
+        {
+            strcpy(dest, "n/a");
+            return 3;
+        }
+
+        int32_t hundredths = (int32_t)raw * 100;
+        if (hundredths < 0)
+        {
+            *p++ = '-';
+            hundredths = -hundredths;
         }
-        return result;
+        hundredths = (hundredths + 8) >> 4;
+
+        uint16_t whole = hundredths / 100;
+        uint8_t fraction = hundredths % 100;
+
+        char digits[5];
+        uint8_t n = 0;
+        do
+        {
+            digits[n++] = '0' + whole % 10;
+            whole /= 10;
+        } while (whole);
+
+        while (n)
+            *p++ = digits[--n];
+
+        *p++ = '.';
+        *p++ = '0' + fraction / 10;
+        *p++ = '0' + fraction % 10;
+        *p = 0;
+
+        return p - dest;
     }
 
     void InitSensors()
     {
-        Serial.print("Locating 1-wire devices...");
+        Serial.print(F("Locating 1-wire devices..."));
         sensors.begin();
-        Serial.print("Found ");
+        Serial.print(F("Found "));
         oneWireDevicesCount = sensors.getDeviceCount();
         Serial.print(oneWireDevicesCount, DEC);
-        Serial.println(" device(s).");
+        Serial.println(F(" device(s)."));
 
         if (oneWireDevicesCount > 0)
         {
@@ -53,35 +111,180 @@ namespace tempSensors
                     Serial.println("Unable to find address for Device " + (String)i);
 
                 sensors.getAddress(thermometers[i].deviceAddress, i);
-                Serial.print("Device ");
+                Serial.print(F("Device "));
                 Serial.print(i);
-                Serial.print(":\t");
-                Serial.print(OneWireDeviceAddress2HEX(thermometers[i].deviceAddress, ':'));
+                Serial.print(F(":\t"));
+                OneWireDeviceAddress2HEX(thermometers[i].deviceAddress, ':', thermometers[i].addressHEX);
+                Serial.print(thermometers[i].addressHEX);
                 Serial.println();
                 thermometers[i].parasitePowered = sensors.isParasitePowerMode();
                 thermometers[i].resolution = DS1820_RESOLUTION;
+                thermometers[i].rawTemperature = TEMPERATURE_INVALID;
+                thermometers[i].filteredTemperature = TEMPERATURE_INVALID;
                 sensors.setResolution(thermometers[i].deviceAddress, thermometers[i].resolution);
-                thermometers[i].FriendlyName = OneWireDeviceAddress2HEX(thermometers[i].deviceAddress, ':');
+                strlcpy(thermometers[i].friendlyName, thermometers[i].addressHEX, sizeof(thermometers[i].friendlyName));
             }
         }
     }
 
+    //  Reads the scratchpad of a single sensor and converts it to 1/16 °C units,
+    //  telling apart a missing device (no presence pulse) from a corrupted transfer.
+    READ_RESULTS ReadSensor(const thermometer &t, int16_t &raw)
+    {
+        ScratchPad scratchPad;
+
+        if (!sensors.readScratchPad(t.deviceAddress, scratchPad))
+            return READ_DISCONNECTED;
+
+        bool allZeros = true;
+        for (uint8_t i = 0; i < sizeof(ScratchPad); i++)
+            if (scratchPad[i] != 0)
+                allZeros = false;
+
+        if (allZeros || OneWire::crc8(scratchPad, SCRATCHPAD_CRC_BYTE) != scratchPad[SCRATCHPAD_CRC_BYTE])
+            return READ_CRC_ERROR;
+
+        raw = (int16_t)((scratchPad[SCRATCHPAD_TEMP_MSB] << 8) | scratchPad[SCRATCHPAD_TEMP_LSB]);
+
+        //  DS18S20 reports in 1/2 °C steps
+        if (t.deviceAddress[0] == DS18S20_FAMILY_CODE)
+            raw = raw << 3;
+
+        if (raw == POWER_ON_RESET_RAW)
+            return READ_POWER_ON_RESET;
+
+        return READ_OK;
+    }
+
     void ReadTemperatures()
     {
         sensors.requestTemperatures(); // Send the command to get temperatures
         for (size_t i = 0; i < oneWireDevicesCount; i++)
         {
-            thermometers[i].measuredTemperatureC = sensors.getTempC(thermometers[i].deviceAddress);
-            if (thermometers[i].measuredTemperatureC != -127)
+            thermometer &t = thermometers[i];
+            int16_t raw = 0;
+            READ_RESULTS result;
+            uint8_t attempt = 0;
+
+            while (true)
+            {
+                result = ReadSensor(t, raw);
+
+                switch (result)
+                {
+                case READ_OK:
+                    break;
+                case READ_DISCONNECTED:
+                    t.statistics.disconnects++;
+                    break;
+                case READ_CRC_ERROR:
+                    t.statistics.crcErrors++;
+                    break;
+                case READ_POWER_ON_RESET:
+                    t.statistics.powerOnResets++;
+                    break;
+                }
+
+                if (result == READ_OK || attempt++ >= TEMPERATURE_READ_RETRIES)
+                    break;
+
+                t.statistics.retries++;
+
+                //  85 °C is the power-on value of the scratchpad: the sensor browned out
+                //  and lost the conversion, so it has to be started again.
+                if (result == READ_POWER_ON_RESET)
+                    sensors.requestTemperaturesByAddress(t.deviceAddress);
+            }
+
+            //  A persistent 85 °C can be a genuine reading, so it is accepted after the retries
+            if (result == READ_OK || result == READ_POWER_ON_RESET)
+            {
+                t.statistics.goodReads++;
+                t.rawTemperature = raw;
+                t.filteredTemperature = filters::Apply(i, raw);
+                boot::Mark(boot::BOOT_FIRST_READING);
+                history::AddReading(i, t.filteredTemperature);
+                datalog::LogTemperature(i, t.filteredTemperature);
+
+                if (filters::ShouldPublish(i, t.filteredTemperature))
+                {
+                    char topic[sizeof(THERMOMETERS_TOPIC) + THERMOMETER_ADDRESS_LENGTH];
+                    char payload[TEMPERATURE_STRING_LENGTH];
+
+                    strcpy(topic, THERMOMETERS_TOPIC);
+                    strcat(topic, t.addressHEX);
+                    FormatTemperature(t.filteredTemperature, payload);
+
+                    mqtt::PublishData(topic, payload, false);
+                }
+            }
+            else
             {
-                mqtt::PublishData(("thermometers/" + OneWireDeviceAddress2HEX(thermometers[i].deviceAddress, ':')).c_str(), (String(thermometers[i].measuredTemperatureC)).c_str(), false);
+                t.statistics.failedReads++;
+                t.rawTemperature = TEMPERATURE_INVALID;
+#ifdef __debugSettings
+                Serial.printf_P(PSTR("Failed to read sensor %s.\r\n"), t.addressHEX);
+#endif
             }
         }
     }
 
+    void StatisticsToJson(const readStatistics &statistics, JsonObject obj)
+    {
+        obj["GoodReads"] = statistics.goodReads;
+        obj["CrcErrors"] = statistics.crcErrors;
+        obj["Disconnects"] = statistics.disconnects;
+        obj["PowerOnResets"] = statistics.powerOnResets;
+        obj["Retries"] = statistics.retries;
+        obj["FailedReads"] = statistics.failedReads;
+    }
+
+    void TotalStatisticsToJson(JsonObject obj)
+    {
+        readStatistics total = {};
+
+        for (size_t i = 0; i < oneWireDevicesCount; i++)
+        {
+            total.goodReads += thermometers[i].statistics.goodReads;
+            total.crcErrors += thermometers[i].statistics.crcErrors;
+            total.disconnects += thermometers[i].statistics.disconnects;
+            total.powerOnResets += thermometers[i].statistics.powerOnResets;
+            total.retries += thermometers[i].statistics.retries;
+            total.failedReads += thermometers[i].statistics.failedReads;
+        }
+
+        obj["Count"] = oneWireDevicesCount;
+        StatisticsToJson(total, obj);
+    }
+
+    void PublishStatistics()
+    {
+        for (size_t i = 0; i < oneWireDevicesCount; i++)
+        {
+            StaticJsonDocument<192> doc;
+            StatisticsToJson(thermometers[i].statistics, doc.to<JsonObject>());
+
+            char payload[192];
+            serializeJson(doc, payload, sizeof(payload));
+
+            char topic[sizeof(THERMOMETERS_TOPIC) + THERMOMETER_ADDRESS_LENGTH + 6];
+            strcpy(topic, THERMOMETERS_TOPIC);
+            strcat(topic, thermometers[i].addressHEX);
+            strcat(topic, "/stats");
+
+            mqtt::PublishData(topic, payload, false);
+        }
+    }
+
     void setup()
     {
         InitSensors();
+        filters::setup();
+
+#ifdef __fastBoot
+        //  The first reading is taken on the first pass instead of a full interval later
+        oldTemperatureMillis = millis() - settings::temperatureRefreshInterval * 1000 - 1;
+#endif
     }
 
     void loop()
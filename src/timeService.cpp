@@ -0,0 +1,128 @@
+#include <Arduino.h>
+#include <TimeLib.h>
+
+#include "timeService.h"
+#include "TimeChangeRules.h"
+#include "settings.h"
+#include "logger.h"
+#include "ntp.h"
+
+#define TRANSITION_SEARCH_DAYS 366
+
+namespace timeService
+{
+    int32_t offsetSeconds = 0;
+    const char *abbreviation = "";
+
+    //  The cached offset is good for UTC times in [validFrom, validUntil)
+    time_t validFrom = 0;
+    time_t validUntil = 0;
+    int8_t cachedZone = -1;
+
+    //  Finds the first second after utc where the DST state differs, or gives up after a year
+    time_t NextTransition(Timezone *tz, time_t utc)
+    {
+        bool dst = tz->utcIsDST(utc);
+        time_t low = utc, high = 0;
+
+        for (uint16_t day = 1; day <= TRANSITION_SEARCH_DAYS; day++)
+        {
+            time_t probe = utc + day * SECS_PER_DAY;
+            if (tz->utcIsDST(probe) != dst)
+            {
+                high = probe;
+                break;
+            }
+            low = probe;
+        }
+
+        //  No DST in this zone
+        if (!high)
+            return low;
+
+        while (high - low > 1)
+        {
+            time_t middle = low + (high - low) / 2;
+            if (tz->utcIsDST(middle) == dst)
+                low = middle;
+            else
+                high = middle;
+        }
+
+        return high;
+    }
+
+    void Refresh(time_t utc)
+    {
+        if (cachedZone == settings::timeZone && utc >= validFrom && utc < validUntil)
+            return;
+
+        Timezone *tz = timechangerules::timezones[settings::timeZone];
+        TimeChangeRule *tcr;
+        int32_t previousOffset = offsetSeconds;
+        //  Reaching the end of the range on time is a transition, NTP setting the clock is not
+        bool transition = cachedZone == settings::timeZone && utc >= validUntil && utc - validUntil < SECS_PER_HOUR;
+
+        offsetSeconds = tz->toLocal(utc, &tcr) - utc;
+        abbreviation = tcr->abbrev;
+        validFrom = utc;
+        validUntil = NextTransition(tz, utc);
+        cachedZone = settings::timeZone;
+
+        if (transition && offsetSeconds != previousOffset)
+            logger::LogEvent(logger::DSTChange, 1, "DST change", abbreviation);
+    }
+
+    time_t ToLocal(time_t utc)
+    {
+        Refresh(utc);
+        return utc + offsetSeconds;
+    }
+
+    time_t Local()
+    {
+        return ToLocal(now());
+    }
+
+    int32_t Offset()
+    {
+        Refresh(now());
+        return offsetSeconds;
+    }
+
+    const char *ZoneAbbreviation()
+    {
+        Refresh(now());
+        return abbreviation;
+    }
+
+    char *FormatLocal(char *dest)
+    {
+        time_t t = Local();
+        sprintf(dest, "%u-%02u-%02u %02u:%02u:%02u", year(t), month(t), day(t), hour(t), minute(t), second(t));
+        return dest;
+    }
+
+    char *FormatIso8601(char *dest)
+    {
+        time_t t = Local();
+        uint32_t offset = abs(offsetSeconds);
+
+        sprintf(dest, "%04u-%02u-%02uT%02u:%02u:%02u%c%02u:%02u", year(t), month(t), day(t), hour(t), minute(t), second(t),
+                offsetSeconds < 0 ? '-' : '+', offset / 3600, offset / 60 % 60);
+        return dest;
+    }
+
+    //  Millisecond resolution once NTP has synced, whole seconds before that
+    uint64_t EpochMs()
+    {
+        return ntp::IsSynced() ? ntp::EpochMs() : (uint64_t)now() * 1000;
+    }
+
+    //  printf on the ESP8266 has no 64-bit support
+    char *FormatEpochMs(uint64_t epochMs, char *dest)
+    {
+        sprintf(dest, "%u%03u", (uint32_t)(epochMs / 1000), (uint32_t)(epochMs % 1000));
+        return dest;
+    }
+}